@@ -0,0 +1,459 @@
+/*
+ * envbench -- benchmark the CRC32 and conversion kernels and the I/O of
+ * mkubootenv on synthetic environments, see "make bench".
+ */
+
+#define _GNU_SOURCE		/* for mkdtemp() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "convert.h"
+#include "crc32.h"
+#include "envimage.h"
+
+#define CMD_NAME		"envbench"
+
+#define err(fmt, args...)	fprintf(stderr, "%s: Error: " fmt, CMD_NAME, ##args)
+
+/* image sizes, from a single flash page to a large eMMC environment */
+static const size_t bench_sizes[] = {
+	256, 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024,
+};
+#define NR_SIZES	(sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+/* a sparse env only fills this fraction of the image, the rest is padding */
+#define SPARSE_FRACTION	16
+
+/* minimum time spent on each measurement */
+static uint64_t bench_time = 100 * 1000 * 1000;
+
+/* keeps the compiler from dropping the benchmarked calls */
+static volatile uint64_t bench_sink;
+
+struct bench_job {
+	uint8_t *text;
+	size_t text_len;
+	uint8_t *img;
+	uint8_t *out;
+	size_t size;
+	unsigned int flags;
+	struct env_encode_opts opts;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* run fn until bench_time has passed and return the mean time of a run in ns */
+static double bench_run(int (*fn)(struct bench_job *j), struct bench_job *j)
+{
+	uint64_t start, t;
+	unsigned long n = 0;
+
+	/* warm up caches and page tables */
+	if (fn(j))
+		return -1.0;
+
+	start = now_ns();
+	do {
+		if (fn(j))
+			return -1.0;
+		n++;
+		t = now_ns() - start;
+	} while (t < bench_time);
+
+	return (double) t / n;
+}
+
+static const char *size_str(size_t size)
+{
+	static char buf[24];
+
+	if (size >= 1024 * 1024 && size % (1024 * 1024) == 0)
+		snprintf(buf, sizeof(buf), "%zuM", size / (1024 * 1024));
+	else if (size >= 1024 && size % 1024 == 0)
+		snprintf(buf, sizeof(buf), "%zuK", size / 1024);
+	else
+		snprintf(buf, sizeof(buf), "%zu", size);
+
+	return buf;
+}
+
+static void report(const char *op, const char *kernel, size_t size,
+		   const char *variant, double ns)
+{
+	if (ns < 0) {
+		printf("%-7s %-7s %4s %-16s %12s\n", op, kernel, size_str(size),
+		       variant, "failed");
+		return;
+	}
+
+	printf("%-7s %-7s %4s %-16s %9.1f MB/s %12.0f ns\n", op, kernel,
+	       size_str(size), variant, size / ns * 1000.0, ns);
+	fflush(stdout);
+}
+
+/*
+ * Fill buf with len bytes of env text: lines of varying length, each with a
+ * distinct variable name, the last line ending in '\n'.
+ */
+static size_t gen_env(uint8_t *buf, size_t len)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789 ,.:;/";
+	uint32_t x = 2463534242u;
+	unsigned int i = 0;
+	size_t pos = 0, n, k;
+	char name[24];
+
+	while (true) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		n = snprintf(name, sizeof(name), "var%u=", i++);
+		/* values of 4 to 123 bytes */
+		k = 4 + x % 120;
+		if (pos + n + k + 1 > len)
+			break;
+		memcpy(buf + pos, name, n);
+		pos += n;
+		while (k--) {
+			buf[pos++] = chars[x % (sizeof(chars) - 1)];
+			x = x * 1103515245 + 12345;
+		}
+		buf[pos++] = '\n';
+	}
+
+	return pos;
+}
+
+static int bench_crc32(struct bench_job *j)
+{
+	bench_sink += crc32_update(0, j->img, j->size);
+	return 0;
+}
+
+static int bench_encode(struct bench_job *j)
+{
+	ssize_t ret;
+
+	ret = env_encode(j->text, j->text_len, j->img, j->size, j->flags, &j->opts);
+	bench_sink += ret;
+	return ret < 0;
+}
+
+static int bench_decode(struct bench_job *j)
+{
+	ssize_t ret;
+
+	ret = env_decode(j->img, j->size, j->out, j->size, j->flags, NULL);
+	bench_sink += ret;
+	return ret < 0;
+}
+
+static int bench_check(struct bench_job *j)
+{
+	struct env_info info;
+
+	if (env_check(j->img, j->size, j->flags, &info))
+		return -1;
+	bench_sink += info.data_len;
+	return !info.crc_ok;
+}
+
+static const struct {
+	const char *name;
+	int (*fn)(struct bench_job *j);
+} bench_ops[] = {
+	{ "encode", bench_encode },
+	{ "decode", bench_decode },
+	{ "check", bench_check },
+};
+#define NR_OPS		(sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+/* the CRC32 kernels alone, over random data */
+static void bench_crc32_kernels(struct bench_job *j)
+{
+	unsigned int k, s;
+	size_t i;
+
+	for (i = 0; i < bench_sizes[NR_SIZES - 1]; i++)
+		j->img[i] = rand();
+	for (k = 0; crc32_kernels[k]; k++) {
+		if (crc32_select(crc32_kernels[k]))
+			continue;
+		for (s = 0; s < NR_SIZES; s++) {
+			j->size = bench_sizes[s];
+			report("crc32", crc32_kernels[k], j->size, "",
+			       bench_run(bench_crc32, j));
+		}
+	}
+}
+
+/* the library functions with each conversion kernel and the default CRC32 */
+static void bench_library(struct bench_job *j)
+{
+	unsigned int k, s, v, o;
+	bool sparse, redundant;
+	char variant[32];
+	size_t text_size;
+
+	for (k = 0; convert_kernels[k]; k++) {
+		if (convert_select(convert_kernels[k]))
+			continue;
+		for (s = 0; s < NR_SIZES * 4; s++) {
+			/* each size dense and sparse, without and with flags byte */
+			v = s % 4;
+			sparse = v & 2;
+			redundant = v & 1;
+			j->size = bench_sizes[s / 4];
+			j->flags = redundant ? ENV_REDUNDANT : 0;
+			j->opts.flag = 1;
+			text_size = j->size - env_encoded_size(0, j->flags);
+			if (sparse)
+				text_size /= SPARSE_FRACTION;
+			j->text_len = gen_env(j->text, text_size);
+			snprintf(variant, sizeof(variant), "%s %s",
+				 sparse ? "sparse" : "dense",
+				 redundant ? "redundant" : "single");
+			/* encode first, decode and check work on its image */
+			for (o = 0; o < NR_OPS; o++)
+				report(bench_ops[o].name, convert_kernels[k],
+				       j->size, variant,
+				       bench_run(bench_ops[o].fn, j));
+		}
+	}
+}
+
+/* what is piped from or into mkubootenv, see bench_io() */
+struct bench_cmd {
+	const char *argv[8];
+	const uint8_t *in;	/* written to stdin if set */
+	size_t in_len;
+	bool out;		/* read and discard stdout */
+};
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* run mkubootenv once, returns 0 if it exited successfully */
+static int run_cmd(const struct bench_cmd *cmd)
+{
+	int in[2] = { -1, -1 }, out[2] = { -1, -1 }, status, ret = 0;
+	char buf[64 * 1024];
+	pid_t pid;
+	int fd;
+
+	if ((cmd->in && pipe(in)) || (cmd->out && pipe(out)))
+		return -1;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		if (cmd->in) {
+			dup2(in[0], STDIN_FILENO);
+			close(in[0]);
+			close(in[1]);
+		}
+		if (cmd->out) {
+			dup2(out[1], STDOUT_FILENO);
+			close(out[0]);
+			close(out[1]);
+		}
+		/* keep the reports of --update out of the results */
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0)
+			dup2(fd, STDERR_FILENO);
+		execv(cmd->argv[0], (char *const *) cmd->argv);
+		_exit(127);
+	}
+
+	if (cmd->in) {
+		close(in[0]);
+		ret = write_all(in[1], cmd->in, cmd->in_len);
+		close(in[1]);
+	}
+	if (cmd->out) {
+		close(out[1]);
+		while (read(out[0], buf, sizeof(buf)) > 0)
+			;
+		close(out[0]);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		return -1;
+
+	return ret || !WIFEXITED(status) || WEXITSTATUS(status) ? -1 : 0;
+}
+
+static struct bench_cmd *bench_cmd;
+
+static int bench_exec(struct bench_job *j)
+{
+	(void) j;
+	return run_cmd(bench_cmd);
+}
+
+static int save_file(const char *name, const uint8_t *buf, size_t len)
+{
+	int fd, ret;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	ret = write_all(fd, buf, len);
+	if (close(fd))
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * The whole mkubootenv process per image, through each of its I/O paths:
+ * mapped source file, source streamed from a pipe, target streamed to a pipe,
+ * --update of an existing target and reverse conversion. Regular targets are
+ * mapped from MMAP_MIN_SIZE (1 MiB) on and written from a buffer below.
+ */
+static void bench_io(struct bench_job *j, const char *prog)
+{
+	char dir[] = "/tmp/envbench.XXXXXX", src[64], dst[64], txt[64], size[32];
+	const char *tmpdir = getenv("TMPDIR");
+	char dirbuf[256];
+	unsigned int s, b;
+
+	if (tmpdir) {
+		snprintf(dirbuf, sizeof(dirbuf), "%s/envbench.XXXXXX", tmpdir);
+		tmpdir = mkdtemp(dirbuf);
+	} else
+		tmpdir = mkdtemp(dir);
+	if (!tmpdir) {
+		err("Could not create temporary directory: %s\n", strerror(errno));
+		return;
+	}
+	snprintf(src, sizeof(src), "%.40s/env.txt", tmpdir);
+	snprintf(dst, sizeof(dst), "%.40s/env.bin", tmpdir);
+	snprintf(txt, sizeof(txt), "%.40s/out.txt", tmpdir);
+
+	for (s = 1; s < NR_SIZES; s++) {
+		struct bench_cmd cmds[] = {
+			{ { prog, "-s", size, src, dst, NULL }, NULL, 0, false },
+			{ { prog, "-s", size, "-", dst, NULL }, j->text, 0, false },
+			{ { prog, "-s", size, src, "-", NULL }, NULL, 0, true },
+			{ { prog, "--update", "-s", size, src, dst, NULL }, NULL, 0, false },
+			{ { prog, "-r", dst, txt, NULL }, NULL, 0, false },
+		};
+		static const char *const names[] = {
+			"file", "stdin", "stdout", "update", "reverse",
+		};
+
+		j->size = bench_sizes[s];
+		snprintf(size, sizeof(size), "%zu", j->size);
+		j->text_len = gen_env(j->text,
+				      j->size - env_encoded_size(0, 0));
+		cmds[1].in_len = j->text_len;
+		if (save_file(src, j->text, j->text_len) || run_cmd(&cmds[0])) {
+			err("Could not run %s\n", prog);
+			break;
+		}
+		for (b = 0; b < sizeof(cmds) / sizeof(cmds[0]); b++) {
+			bench_cmd = &cmds[b];
+			report("exec", names[b], j->size, "dense single",
+			       bench_run(bench_exec, j));
+		}
+	}
+
+	unlink(src);
+	unlink(dst);
+	unlink(txt);
+	rmdir(tmpdir);
+}
+
+static void usage_and_exit(int status) __attribute__((noreturn));
+
+static void usage_and_exit(int status)
+{
+	fprintf(status ? stderr : stdout,
+		"usage: " CMD_NAME " [-t <ms>] [<mkubootenv binary>]\n"
+		"Options:\n"
+		"  -t <ms>  spend at least <ms> milliseconds on each measurement\n"
+		"           (default 100)\n"
+		"Without <mkubootenv binary>, only the library is benchmarked.\n");
+	exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_job j;
+	size_t max = bench_sizes[NR_SIZES - 1];
+	int c;
+
+	while ((c = getopt(argc, argv, "t:h")) != -1) {
+		switch (c) {
+		case 't':
+			bench_time = strtoull(optarg, NULL, 0) * 1000 * 1000;
+			break;
+		case 'h':
+			usage_and_exit(EXIT_SUCCESS);
+		default:
+			usage_and_exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind > 1)
+		usage_and_exit(EXIT_FAILURE);
+	/* a failing mkubootenv shouldn't kill us while feeding its stdin */
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&j, 0, sizeof(j));
+	j.text = malloc(max);
+	j.img = malloc(max);
+	j.out = malloc(max);
+	if (!j.text || !j.img || !j.out) {
+		err("Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_crc32_kernels(&j);
+	/* back to the fastest CRC32 kernel */
+	for (c = 0; crc32_kernels[c]; c++)
+		crc32_select(crc32_kernels[c]);
+	bench_library(&j);
+	if (optind < argc)
+		bench_io(&j, argv[optind]);
+
+	free(j.text);
+	free(j.img);
+	free(j.out);
+
+	return 0;
+}
@@ -0,0 +1,582 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+#include "convert.h"
+#include "crc32.h"
+
+/*
+ * Block size for hashing in convert_env(). Each block is converted and then
+ * hashed while it is still in the L1/L2 cache.
+ */
+#define CONVERT_CRC32_BLOCK	(16 * 1024)
+
+static void convert_scalar(uint8_t *dst, const uint8_t *src, size_t len,
+			   uint8_t from, uint8_t to)
+{
+	const uint8_t *end;
+
+	for (end = src + len; src < end; src++, dst++)
+		*dst = (*src == from) ? to : *src;
+}
+
+/*
+ * The vector kernels compare a whole vector against from and flip the
+ * matching bytes to to by XORing them with (from ^ to).
+ */
+#if defined(__SSE2__)
+static void convert_sse2(uint8_t *dst, const uint8_t *src, size_t len,
+			 uint8_t from, uint8_t to)
+{
+	const __m128i vfrom = _mm_set1_epi8(from);
+	const __m128i vdiff = _mm_set1_epi8(from ^ to);
+	__m128i x;
+
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		x = _mm_loadu_si128((const __m128i *) src);
+		x = _mm_xor_si128(x, _mm_and_si128(_mm_cmpeq_epi8(x, vfrom), vdiff));
+		_mm_storeu_si128((__m128i *) dst, x);
+	}
+
+	convert_scalar(dst, src, len, from, to);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void convert_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+			 uint8_t from, uint8_t to)
+{
+	const __m256i vfrom = _mm256_set1_epi8(from);
+	const __m256i vdiff = _mm256_set1_epi8(from ^ to);
+	__m256i x;
+
+	for (; len >= 32; len -= 32, src += 32, dst += 32) {
+		x = _mm256_loadu_si256((const __m256i *) src);
+		x = _mm256_xor_si256(x, _mm256_and_si256(_mm256_cmpeq_epi8(x, vfrom), vdiff));
+		_mm256_storeu_si256((__m256i *) dst, x);
+	}
+
+	convert_scalar(dst, src, len, from, to);
+}
+#endif
+
+#if defined(__aarch64__)
+static void convert_neon(uint8_t *dst, const uint8_t *src, size_t len,
+			 uint8_t from, uint8_t to)
+{
+	const uint8x16_t vfrom = vdupq_n_u8(from);
+	const uint8x16_t vdiff = vdupq_n_u8(from ^ to);
+	uint8x16_t x;
+
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		x = vld1q_u8(src);
+		x = veorq_u8(x, vandq_u8(vceqq_u8(x, vfrom), vdiff));
+		vst1q_u8(dst, x);
+	}
+
+	convert_scalar(dst, src, len, from, to);
+}
+#endif
+
+/*
+ * Double NUL search kernels, returning the offset of the first of two
+ * adjacent NUL bytes or len if there are none. The vector kernels OR each
+ * vector with the same vector shifted by one byte, so a zero byte in the
+ * result marks the start of a pair.
+ */
+static size_t find_double_nul_scalar(const uint8_t *buf, size_t len)
+{
+	const uint8_t *p, *end = buf + len;
+
+	/* end - 1 would point in front of an empty buffer */
+	if (len < 2)
+		return len;
+	for (p = buf; p < end - 1; p++) {
+		p = memchr(p, '\0', end - 1 - p);
+		if (!p)
+			break;
+		if (*(p + 1) == '\0')
+			return p - buf;
+	}
+
+	return len;
+}
+
+#if defined(__SSE2__)
+static size_t find_double_nul_sse2(const uint8_t *buf, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i x;
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 < len; i += 16) {
+		x = _mm_or_si128(_mm_loadu_si128((const __m128i *) (buf + i)),
+				 _mm_loadu_si128((const __m128i *) (buf + i + 1)));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + find_double_nul_scalar(buf + i, len - i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t find_double_nul_avx2(const uint8_t *buf, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i x;
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 32 < len; i += 32) {
+		x = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (buf + i)),
+				    _mm256_loadu_si256((const __m256i *) (buf + i + 1)));
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + find_double_nul_scalar(buf + i, len - i);
+}
+#endif
+
+#if defined(__aarch64__)
+static size_t find_double_nul_neon(const uint8_t *buf, size_t len)
+{
+	uint8x16_t x;
+	size_t i;
+
+	for (i = 0; i + 16 < len; i += 16) {
+		x = vorrq_u8(vld1q_u8(buf + i), vld1q_u8(buf + i + 1));
+		/* any zero byte in this vector? */
+		if (vminvq_u8(x) == 0)
+			break;
+	}
+
+	return i + find_double_nul_scalar(buf + i, len - i);
+}
+#endif
+
+/*
+ * Env text conversion with line checks, see convert_env(). The chunk kernels
+ * convert 64 bytes like convert() and return bit masks of the newlines, '='
+ * and '\r' bytes in them. The lines are checked using the masks only, so the
+ * bytes aren't looked at a second time.
+ */
+#define ENV_CHUNK	64
+#define NO_EQ		SIZE_MAX
+
+struct env_masks {
+	uint64_t nl;
+	uint64_t eq;
+	uint64_t cr;
+};
+
+static inline __attribute__((always_inline))
+void env_chunk_scalar(uint8_t *dst, const uint8_t *src, struct env_masks *m)
+{
+	unsigned int i;
+
+	m->nl = m->eq = m->cr = 0;
+	for (i = 0; i < ENV_CHUNK; i++) {
+		m->nl |= (uint64_t) (src[i] == '\n') << i;
+		m->eq |= (uint64_t) (src[i] == '=') << i;
+		m->cr |= (uint64_t) (src[i] == '\r') << i;
+		dst[i] = src[i] == '\n' ? '\0' : src[i];
+	}
+}
+
+#if defined(__SSE2__)
+static inline __attribute__((always_inline))
+void env_chunk_sse2(uint8_t *dst, const uint8_t *src, struct env_masks *m)
+{
+	const __m128i vnl = _mm_set1_epi8('\n');
+	const __m128i veq = _mm_set1_epi8('=');
+	const __m128i vcr = _mm_set1_epi8('\r');
+	__m128i x, n;
+	unsigned int i;
+
+	m->nl = m->eq = m->cr = 0;
+	for (i = 0; i < ENV_CHUNK; i += 16) {
+		x = _mm_loadu_si128((const __m128i *) (src + i));
+		n = _mm_cmpeq_epi8(x, vnl);
+		m->nl |= (uint64_t) _mm_movemask_epi8(n) << i;
+		m->eq |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(x, veq)) << i;
+		m->cr |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(x, vcr)) << i;
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(x, _mm_and_si128(n, vnl)));
+	}
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline __attribute__((always_inline, target("avx2")))
+void env_chunk_avx2(uint8_t *dst, const uint8_t *src, struct env_masks *m)
+{
+	const __m256i vnl = _mm256_set1_epi8('\n');
+	const __m256i veq = _mm256_set1_epi8('=');
+	const __m256i vcr = _mm256_set1_epi8('\r');
+	__m256i x, y, n, o;
+
+	x = _mm256_loadu_si256((const __m256i *) src);
+	y = _mm256_loadu_si256((const __m256i *) (src + 32));
+	n = _mm256_cmpeq_epi8(x, vnl);
+	o = _mm256_cmpeq_epi8(y, vnl);
+	m->nl = (uint32_t) _mm256_movemask_epi8(n) |
+		(uint64_t) (uint32_t) _mm256_movemask_epi8(o) << 32;
+	m->eq = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, veq)) |
+		(uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(y, veq)) << 32;
+	m->cr = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, vcr)) |
+		(uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(y, vcr)) << 32;
+	_mm256_storeu_si256((__m256i *) dst, _mm256_xor_si256(x, _mm256_and_si256(n, vnl)));
+	_mm256_storeu_si256((__m256i *) (dst + 32), _mm256_xor_si256(y, _mm256_and_si256(o, vnl)));
+}
+#endif
+
+#if defined(__aarch64__)
+/* NEON has no movemask, weigh each lane by its bit and add them up */
+static inline uint64_t neon_mask16(uint8x16_t cmp)
+{
+	static const uint8_t bits[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+	};
+	uint8x16_t m = vandq_u8(cmp, vld1q_u8(bits));
+
+	return vaddv_u8(vget_low_u8(m)) | (uint64_t) vaddv_u8(vget_high_u8(m)) << 8;
+}
+
+static inline __attribute__((always_inline))
+void env_chunk_neon(uint8_t *dst, const uint8_t *src, struct env_masks *m)
+{
+	const uint8x16_t vnl = vdupq_n_u8('\n');
+	uint8x16_t x, n;
+	unsigned int i;
+
+	m->nl = m->eq = m->cr = 0;
+	for (i = 0; i < ENV_CHUNK; i += 16) {
+		x = vld1q_u8(src + i);
+		n = vceqq_u8(x, vnl);
+		m->nl |= neon_mask16(n) << i;
+		m->eq |= neon_mask16(vceqq_u8(x, vdupq_n_u8('='))) << i;
+		m->cr |= neon_mask16(vceqq_u8(x, vdupq_n_u8('\r'))) << i;
+		vst1q_u8(dst + i, veorq_u8(x, vandq_u8(n, vnl)));
+	}
+}
+#endif
+
+/* bits lo..hi-1 of a chunk mask, 0 <= lo, hi <= 64 */
+static inline uint64_t env_bits(uint64_t mask, unsigned int lo, unsigned int hi)
+{
+	if (lo >= hi)
+		return 0;
+
+	return mask & (~0ull << lo) & (~0ull >> (ENV_CHUNK - hi));
+}
+
+/*
+ * Check whether all lines ending in the chunk have a '=', but not at the
+ * start, without looking at each line. The line starts are the bits after
+ * each newline, plus bit 0 if the current line hasn't had a '=' yet. Adding
+ * them to the mask of the other bytes carries each of them to the next
+ * newline or '=', so the lines without '=' are those landing on a newline.
+ * A carry out of the chunk is fine, that line ends later.
+ */
+static inline bool env_chunk_ok(const struct env_masks *m, bool at_start,
+				bool no_eq)
+{
+	uint64_t starts = m->nl << 1 | at_start;
+	uint64_t other = ~(m->nl | m->eq);
+	uint64_t land = ((m->nl << 1 | no_eq) + other) & ~other;
+
+	return !(land & m->nl) && !(starts & m->eq);
+}
+
+/*
+ * Check the line [line, p) of src ending in a newline (or the end of the
+ * text), whose first '=' is at eq, and report its problems. Only called for
+ * lines which aren't plain "name=value" lines or to find duplicates. Returns
+ * the number of bytes to drop from the output in front of the newline, or -1
+ * to drop the whole line.
+ */
+static int env_line_check(const struct env_conv *c, const uint8_t *src,
+			  size_t line, size_t eq, size_t p, size_t lineno)
+{
+	size_t len = p - line;
+	bool cr = len > 0 && src[p - 1] == '\r';
+
+	if (len == 0 || (len == 1 && cr && c->strip_cr)) {
+		c->issue(c->arg, ENV_ISSUE_BLANK_LINE, lineno, 1);
+		return -1;
+	}
+	if (cr)
+		c->issue(c->arg, ENV_ISSUE_CR, lineno, len);
+	if (eq == NO_EQ)
+		c->issue(c->arg, ENV_ISSUE_NO_EQUALS, lineno, 1);
+	else if (eq == line)
+		c->issue(c->arg, ENV_ISSUE_EMPTY_NAME, lineno, 1);
+	else if (c->line)
+		c->line(c->arg, src + line, eq - line, lineno);
+
+	return cr && c->strip_cr;
+}
+
+/*
+ * The state is kept in locals, the compiler can't tell whether the stores to
+ * dst modify *c. Each chunk starts within the current line, at its start if
+ * line == pos.
+ */
+static inline __attribute__((always_inline))
+size_t convert_env_lines(uint8_t *dst, const uint8_t *src, size_t len,
+			 struct env_conv *c, uint32_t *crc,
+			 void (*chunk)(uint8_t *, const uint8_t *, struct env_masks *))
+{
+	uint8_t tail_src[ENV_CHUNK], tail_dst[ENV_CHUNK];
+	struct env_masks m;
+	size_t pos = 0, removed = 0, line = 0, eq = NO_EQ, p, n, hashed = 0;
+	size_t lineno = c->lineno;
+	bool cont = c->continued, checked = c->line != NULL;
+	unsigned int lo, b;
+	uint64_t bits;
+	int drop;
+
+	while (pos < len) {
+		n = len - pos;
+		if (n >= ENV_CHUNK) {
+			n = ENV_CHUNK;
+			chunk(dst + pos - removed, src + pos, &m);
+		} else {
+			/* zero bytes never show up in the masks */
+			memset(tail_src, 0, sizeof(tail_src));
+			memcpy(tail_src, src + pos, n);
+			chunk(tail_dst, tail_src, &m);
+			memcpy(dst + pos - removed, tail_dst, n);
+		}
+
+		/* a '\r' in the previous chunk may end a line in this one */
+		if (!checked && !cont && !m.cr && eq != line &&
+		    !((m.nl & 1) && line < pos && src[pos - 1] == '\r') &&
+		    env_chunk_ok(&m, line == pos, eq == NO_EQ)) {
+			/*
+			 * Only plain "name=value" lines end in this chunk.
+			 * Whether one does at all can't be predicted, so the
+			 * state is updated without branching.
+			 */
+			b = 64 - __builtin_clzll(m.nl | 1);
+			lineno += __builtin_popcountll(m.nl);
+			line = m.nl ? pos + b : line;
+			eq = m.nl ? NO_EQ : eq;
+			bits = m.nl ? env_bits(m.eq, b, n) : m.eq;
+			eq = eq == NO_EQ && bits ? pos + __builtin_ctzll(bits) : eq;
+			pos += n;
+		} else {
+			lo = 0;
+			for (bits = m.nl; bits; bits &= bits - 1) {
+				b = __builtin_ctzll(bits);
+				p = pos + b;
+				if (eq == NO_EQ && env_bits(m.eq, lo, b))
+					eq = pos + __builtin_ctzll(env_bits(m.eq, lo, b));
+
+				lineno++;
+				drop = 0;
+				if (cont)
+					cont = false;
+				else if (checked || eq == NO_EQ || eq == line ||
+					 src[p - 1] == '\r')
+					drop = env_line_check(c, src, line, eq, p, lineno);
+
+				if (drop < 0) {
+					removed += p + 1 - line;
+				} else if (drop > 0) {
+					dst[p - 1 - removed] = '\0';
+					removed += drop;
+				}
+				line = p + 1;
+				eq = NO_EQ;
+				lo = b + 1;
+
+				/*
+				 * If bytes of this line were dropped, the rest
+				 * of the chunk has been stored in the wrong
+				 * place. Go on with the next line then.
+				 */
+				if (drop != 0)
+					break;
+			}
+
+			if (bits) {
+				pos = line;
+				continue;
+			}
+			if (eq == NO_EQ && env_bits(m.eq, lo, n))
+				eq = pos + __builtin_ctzll(env_bits(m.eq, lo, n));
+			pos += n;
+		}
+
+		/*
+		 * Hash the output in blocks while they are in the cache. The
+		 * last byte may still be replaced by a dropped '\r'.
+		 */
+		if (crc && pos - removed - hashed > CONVERT_CRC32_BLOCK) {
+			*crc = crc32_update(*crc, dst + hashed,
+					    pos - removed - 1 - hashed);
+			hashed = pos - removed - 1;
+		}
+	}
+
+	/* a last line without newline, unless it goes on */
+	if (line < len && c->more) {
+		cont = true;
+	} else if (line < len) {
+		lineno++;
+		drop = cont ? 0 : env_line_check(c, src, line, eq, len, lineno);
+		if (drop < 0)
+			removed += len - line;
+		else
+			removed += drop;
+		cont = false;
+	}
+
+	if (crc)
+		*crc = crc32_update(*crc, dst + hashed, len - removed - hashed);
+
+	c->lineno = lineno;
+	c->continued = cont;
+	return len - removed;
+}
+
+static size_t convert_env_scalar(uint8_t *dst, const uint8_t *src, size_t len,
+				 struct env_conv *c, uint32_t *crc)
+{
+	return convert_env_lines(dst, src, len, c, crc, env_chunk_scalar);
+}
+
+#if defined(__SSE2__)
+static size_t convert_env_sse2(uint8_t *dst, const uint8_t *src, size_t len,
+			       struct env_conv *c, uint32_t *crc)
+{
+	return convert_env_lines(dst, src, len, c, crc, env_chunk_sse2);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t convert_env_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+			       struct env_conv *c, uint32_t *crc)
+{
+	return convert_env_lines(dst, src, len, c, crc, env_chunk_avx2);
+}
+#endif
+
+#if defined(__aarch64__)
+static size_t convert_env_neon(uint8_t *dst, const uint8_t *src, size_t len,
+			       struct env_conv *c, uint32_t *crc)
+{
+	return convert_env_lines(dst, src, len, c, crc, env_chunk_neon);
+}
+#endif
+
+/* kernels selected at startup, see convert_init() */
+static void (*convert_impl)(uint8_t *dst, const uint8_t *src, size_t len,
+			    uint8_t from, uint8_t to) = convert_scalar;
+static size_t (*find_double_nul_impl)(const uint8_t *buf, size_t len) = find_double_nul_scalar;
+static size_t (*convert_env_impl)(uint8_t *dst, const uint8_t *src, size_t len,
+				  struct env_conv *c, uint32_t *crc) = convert_env_scalar;
+static const char *convert_impl_name = "scalar";
+
+static void convert_init(void) __attribute__((constructor));
+
+static void convert_init(void)
+{
+	unsigned int i;
+
+	/* the last kernel listed is the fastest, fall back to scalar */
+	for (i = 0; convert_kernels[i]; i++)
+		convert_select(convert_kernels[i]);
+}
+
+const char *const convert_kernels[] = {
+	"scalar",
+#if defined(__SSE2__)
+	"sse2",
+#elif defined(__aarch64__)
+	"neon",
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	"avx2",
+#endif
+	NULL
+};
+
+int convert_select(const char *name)
+{
+	if (!strcmp(name, "scalar")) {
+		convert_impl = convert_scalar;
+		find_double_nul_impl = find_double_nul_scalar;
+		convert_env_impl = convert_env_scalar;
+		convert_impl_name = "scalar";
+		return 0;
+	}
+#if defined(__SSE2__)
+	if (!strcmp(name, "sse2")) {
+		convert_impl = convert_sse2;
+		find_double_nul_impl = find_double_nul_sse2;
+		convert_env_impl = convert_env_sse2;
+		convert_impl_name = "sse2";
+		return 0;
+	}
+#elif defined(__aarch64__)
+	if (!strcmp(name, "neon")) {
+		convert_impl = convert_neon;
+		find_double_nul_impl = find_double_nul_neon;
+		convert_env_impl = convert_env_neon;
+		convert_impl_name = "neon";
+		return 0;
+	}
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+		convert_impl = convert_avx2;
+		find_double_nul_impl = find_double_nul_avx2;
+		convert_env_impl = convert_env_avx2;
+		convert_impl_name = "avx2";
+		return 0;
+	}
+#endif
+
+	return -1;
+}
+
+const char *convert_kernel(void)
+{
+	return convert_impl_name;
+}
+
+void convert(uint8_t *dst, const uint8_t *src, size_t len,
+	     uint8_t from, uint8_t to)
+{
+	convert_impl(dst, src, len, from, to);
+}
+
+size_t find_double_nul(const uint8_t *buf, size_t len)
+{
+	if (len < 2)
+		return len;
+
+	return find_double_nul_impl(buf, len);
+}
+
+size_t convert_env(uint8_t *dst, const uint8_t *src, size_t len,
+		   struct env_conv *c, uint32_t *crc)
+{
+	return convert_env_impl(dst, src, len, c, crc);
+}
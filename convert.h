@@ -0,0 +1,49 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "envimage.h"
+
+/* copy len bytes from src to dst, replacing each byte from by to */
+extern void convert(uint8_t *dst, const uint8_t *src, size_t len,
+		    uint8_t from, uint8_t to);
+/* options and state of convert_env(), kept across calls */
+struct env_conv {
+	bool strip_cr;
+	bool more;		/* the last line goes on in the next call */
+	bool continued;		/* the text starts in the middle of a line */
+	size_t lineno;		/* number of lines converted so far */
+	/* called for each problem found, col is 1-based */
+	void (*issue)(void *arg, enum env_issue issue, size_t lineno, size_t col);
+	/* if set, called for each valid line, e.g. to find duplicates */
+	void (*line)(void *arg, const uint8_t *name, size_t name_len, size_t lineno);
+	void *arg;
+};
+
+/*
+ * Convert env text like convert(src, '\n', '\0') and check its lines in the
+ * same pass. Blank lines and, if c->strip_cr is set, '\r' at the end of lines
+ * are dropped. A line split across calls is only checked in part, set
+ * c->more if the text doesn't end at the end of a line. If crc is set,
+ * crc32_update() over the output is calculated as well.
+ * dst must hold len bytes, returns the number of bytes written.
+ */
+extern size_t convert_env(uint8_t *dst, const uint8_t *src, size_t len,
+			  struct env_conv *c, uint32_t *crc);
+/*
+ * return the offset of the first of two adjacent NUL bytes in buf or len if
+ * there are no such bytes
+ */
+extern size_t find_double_nul(const uint8_t *buf, size_t len);
+
+/* names of the conversion kernels built in, NULL terminated */
+extern const char *const convert_kernels[];
+/* use kernel name from now on, returns -1 if the CPU doesn't support it */
+extern int convert_select(const char *name);
+/* name of the kernel in use */
+extern const char *convert_kernel(void);
+
+#endif /* _CONVERT_H_ */
@@ -1,5 +1,20 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# include <arm_acle.h>
+# include <sys/auxv.h>
+# ifndef HWCAP_CRC32
+#  define HWCAP_CRC32	(1 << 7)
+# endif
+# define HAVE_ARMV8_CRC32
+#endif
 
 #include "crc32.h"
 
@@ -59,13 +74,390 @@ static const uint32_t crc32_table[256] = {
 	0x2d02ef8d
 };
 
-uint32_t crc32(uint32_t crc, const uint8_t *buf, size_t len)
+/*
+ * Additional tables for slicing-by-8, derived from crc32_table at startup:
+ * crc32_slice[k][i] is the CRC of byte i followed by k zero bytes.
+ */
+static uint32_t crc32_slice[8][256];
+
+/*
+ * Polynomials modulo the CRC32 polynomial are stored reflected, like the CRC
+ * register: bit 31 is x^0 and bit 0 is x^31. crc32_x2n[k] is x^(2^k) mod P.
+ */
+#define CRC32_POLY	0xedb88320
+static uint32_t crc32_x2n[32];
+
+/* a * b mod P, as done by zlib's multmodp() */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t) 1 << 31, p = 0;
+
+	while (true) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+	       ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/*
+ * The kernels below operate on the raw CRC register, i.e. the caller does the
+ * pre- and post-inversion.
+ */
+static uint32_t crc32_sb8(uint32_t crc, const uint8_t *buf, size_t len)
 {
 	const uint8_t *end;
+	uint32_t hi;
 
-	crc = ~crc;
-	for (end = buf + len; buf < end; buf++)
+	/* slicing-by-8: process 8 bytes per iteration */
+	for (end = buf + (len & ~(size_t) 7); buf < end; buf += 8) {
+		crc ^= get_le32(buf);
+		hi = get_le32(buf + 4);
+		crc = crc32_slice[7][crc & 0xff] ^
+		      crc32_slice[6][(crc >> 8) & 0xff] ^
+		      crc32_slice[5][(crc >> 16) & 0xff] ^
+		      crc32_slice[4][crc >> 24] ^
+		      crc32_slice[3][hi & 0xff] ^
+		      crc32_slice[2][(hi >> 8) & 0xff] ^
+		      crc32_slice[1][(hi >> 16) & 0xff] ^
+		      crc32_slice[0][hi >> 24];
+	}
+
+	/* remaining bytes one at a time */
+	for (end = buf + (len & 7); buf < end; buf++)
 		crc = crc32_table[(crc ^ *buf) & 0xff] ^ (crc >> 8);
 
-	return ~crc;
+	return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Fold 64 bytes at a time using carry-less multiplication, then reduce to 32
+ * bits using Barrett reduction. See Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" white paper; the constants are the
+ * bit-reflected ones for the zlib polynomial given at the end of the paper.
+ *
+ * Requires len >= 64 and len to be a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	len -= 64;
+
+	/* fold 4 x 128 bits in parallel */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *) (buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_loadu_si128((const __m128i *) (buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_loadu_si128((const __m128i *) (buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_loadu_si128((const __m128i *) (buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold into 128 bits */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* fold remaining 128 bit blocks */
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *) buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	/* fold 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	if (len >= 64) {
+		size_t n = len & ~(size_t) 15;
+
+		crc = crc32_pclmul_fold(crc, buf, n);
+		buf += n;
+		len -= n;
+	}
+
+	return crc32_sb8(crc, buf, len);
+}
+#endif
+
+#ifdef HAVE_ARMV8_CRC32
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64_t v;
+
+	for (; len > 0 && ((uintptr_t) buf & 7); len--)
+		crc = __crc32b(crc, *buf++);
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&v, buf, sizeof(v));
+		crc = __crc32d(crc, v);
+	}
+	for (; len > 0; len--)
+		crc = __crc32b(crc, *buf++);
+
+	return crc;
+}
+#endif
+
+/* CRC kernel selected at startup, see crc32_init() */
+static uint32_t (*crc32_impl)(uint32_t crc, const uint8_t *buf, size_t len) = crc32_sb8;
+static const char *crc32_impl_name = "sb8";
+
+static void crc32_init(void) __attribute__((constructor));
+
+static void crc32_init(void)
+{
+	unsigned int i, k;
+	uint32_t c;
+
+	for (i = 0; i < 256; i++) {
+		c = crc32_table[i];
+		crc32_slice[0][i] = c;
+		for (k = 1; k < 8; k++) {
+			c = crc32_table[c & 0xff] ^ (c >> 8);
+			crc32_slice[k][i] = c;
+		}
+	}
+
+	c = (uint32_t) 1 << 30;		/* x^1 */
+	for (i = 0; i < 32; i++) {
+		crc32_x2n[i] = c;
+		c = crc32_multmodp(c, c);
+	}
+
+	/* the last kernel listed is the fastest, fall back to sb8 */
+	for (i = 0; crc32_kernels[i]; i++)
+		crc32_select(crc32_kernels[i]);
+}
+
+const char *const crc32_kernels[] = {
+	"sb8",
+#if defined(__x86_64__) || defined(__i386__)
+	"pclmul",
+#elif defined(HAVE_ARMV8_CRC32)
+	"armv8",
+#endif
+	NULL
+};
+
+int crc32_select(const char *name)
+{
+	if (!strcmp(name, "sb8")) {
+		crc32_impl = crc32_sb8;
+		crc32_impl_name = "sb8";
+		return 0;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (!strcmp(name, "pclmul") && __builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1")) {
+		crc32_impl = crc32_pclmul;
+		crc32_impl_name = "pclmul";
+		return 0;
+	}
+#elif defined(HAVE_ARMV8_CRC32)
+	if (!strcmp(name, "armv8") && (getauxval(AT_HWCAP) & HWCAP_CRC32)) {
+		crc32_impl = crc32_armv8;
+		crc32_impl_name = "armv8";
+		return 0;
+	}
+#endif
+
+	return -1;
+}
+
+const char *crc32_kernel(void)
+{
+	return crc32_impl_name;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	return ~crc32_impl(~crc, buf, len);
+}
+
+/*
+ * Advance the raw CRC register over len zero bytes, i.e. multiply it by
+ * x^(8 * len) mod P, in O(log len) multiplications.
+ */
+static uint32_t crc32_shift(uint32_t crc, size_t len)
+{
+	uint32_t p = (uint32_t) 1 << 31;	/* x^0 */
+	unsigned int k = 3;
+
+	for (; len; len >>= 1, k++) {
+		if (len & 1)
+			p = crc32_multmodp(crc32_x2n[k & 31], p);
+	}
+
+	return crc32_multmodp(p, crc);
+}
+
+uint32_t crc32_zeros(uint32_t crc, size_t len)
+{
+	return ~crc32_shift(~crc, len);
+}
+
+uint32_t crc32_combine_len(uint32_t crc_a, uint32_t crc_b, size_t len_b)
+{
+	return crc32_shift(crc_a, len_b) ^ crc_b;
+}
+
+/* runs of fill bytes up to this length are hashed, that's faster */
+#define CRC32_FILL_HASH_MAX	4096
+
+uint32_t crc32_fill(uint32_t crc, uint8_t c, size_t len)
+{
+	uint32_t fill = 0;	/* raw CRC register over the fill bytes so far */
+	uint32_t xd = (uint32_t) 1 << 31;	/* x^(8 * bytes so far) mod P */
+	uint8_t buf[256];
+	int bit;
+
+	if (c == 0 || len == 0)
+		return crc32_zeros(crc, len);
+
+	if (len <= CRC32_FILL_HASH_MAX) {
+		memset(buf, c, sizeof(buf));
+		for (; len > sizeof(buf); len -= sizeof(buf))
+			crc = crc32_update(crc, buf, sizeof(buf));
+		return crc32_update(crc, buf, len);
+	}
+
+	/* double the run of fill bytes for each bit of len, MSB first */
+	for (bit = sizeof(long) * 8 - 1 - __builtin_clzl(len); bit >= 0; bit--) {
+		fill ^= crc32_multmodp(xd, fill);
+		xd = crc32_multmodp(xd, xd);
+		if ((len >> bit) & 1) {
+			fill = crc32_impl(fill, &c, 1);
+			xd = crc32_multmodp(xd, crc32_x2n[3]);
+		}
+	}
+
+	return ~(crc32_multmodp(xd, ~crc) ^ fill);
+}
+
+/* don't bother spawning a thread for less than this many bytes */
+#define CRC32_PARALLEL_MIN_CHUNK	(1024 * 1024)
+#define CRC32_PARALLEL_MAX_THREADS	64
+
+struct crc32_chunk {
+	pthread_t thread;
+	const uint8_t *buf;
+	size_t len;
+	uint32_t crc;
+};
+
+static void *crc32_chunk_worker(void *arg)
+{
+	struct crc32_chunk *c = arg;
+
+	c->crc = crc32_update(0, c->buf, c->len);
+	return NULL;
+}
+
+uint32_t crc32_parallel(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	struct crc32_chunk chunks[CRC32_PARALLEL_MAX_THREADS];
+	size_t nchunks, chunk_len, i;
+	long ncpus;
+
+	/* too little for two chunks, don't ask for the number of CPUs */
+	if (len < 2 * CRC32_PARALLEL_MIN_CHUNK)
+		return crc32_update(crc, buf, len);
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	nchunks = len / CRC32_PARALLEL_MIN_CHUNK;
+	if (nchunks > (size_t) ncpus)
+		nchunks = ncpus;
+	if (nchunks > CRC32_PARALLEL_MAX_THREADS)
+		nchunks = CRC32_PARALLEL_MAX_THREADS;
+	if (nchunks < 2)
+		return crc32_update(crc, buf, len);
+
+	/* the first chunk is done by the calling thread */
+	chunk_len = len / nchunks;
+	for (i = 1; i < nchunks; i++) {
+		chunks[i].buf = buf + i * chunk_len;
+		chunks[i].len = (i == nchunks - 1) ? len - i * chunk_len : chunk_len;
+		if (pthread_create(&chunks[i].thread, NULL, crc32_chunk_worker,
+				   &chunks[i]) != 0) {
+			/* out of threads, do the rest here */
+			chunks[i].thread = pthread_self();
+			crc32_chunk_worker(&chunks[i]);
+		}
+	}
+
+	crc = crc32_update(crc, buf, chunk_len);
+	for (i = 1; i < nchunks; i++) {
+		if (!pthread_equal(chunks[i].thread, pthread_self()))
+			pthread_join(chunks[i].thread, NULL);
+		crc = crc32_combine_len(crc, chunks[i].crc, chunks[i].len);
+	}
+
+	return crc;
 }
@@ -1,8 +1,24 @@
 #ifndef _CRC32_H_
 #define _CRC32_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
-extern uint32_t crc32(uint32_t crc, const uint8_t *buf, size_t len);
+extern uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len);
+/* same as crc32_update() over len zero bytes, without touching any memory */
+extern uint32_t crc32_zeros(uint32_t crc, size_t len);
+/* same as crc32_update() over len bytes of value c, in O(log^2 len) */
+extern uint32_t crc32_fill(uint32_t crc, uint8_t c, size_t len);
+/* CRC of A followed by B, given the CRCs of both and the length of B */
+extern uint32_t crc32_combine_len(uint32_t crc_a, uint32_t crc_b, size_t len_b);
+/* same as crc32_update(), but split large buffers across all online CPUs */
+extern uint32_t crc32_parallel(uint32_t crc, const uint8_t *buf, size_t len);
+
+/* names of the CRC32 kernels built in, NULL terminated, e.g. for benchmarks */
+extern const char *const crc32_kernels[];
+/* use kernel name from now on, returns -1 if the CPU doesn't support it */
+extern int crc32_select(const char *name);
+/* name of the kernel in use */
+extern const char *crc32_kernel(void);
 
 #endif /* _CRC32_H_ */
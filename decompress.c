@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+
+/* compressed input read from a file at a time */
+#define DECOMP_CHUNK_SIZE	(64 * 1024)
+
+struct decomp {
+	enum decomp_format fmt;
+	int fd;			/* rest of the input, -1 if it's all at in */
+	const uint8_t *in;	/* input not handed to the decompressor yet */
+	size_t in_len;
+	uint8_t *buf;		/* input read from fd */
+	bool end;		/* the last stream or frame is complete */
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zd;
+	ZSTD_inBuffer zin;
+#endif
+};
+
+enum decomp_format decomp_detect(const uint8_t *p, size_t len)
+{
+	if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+		return DECOMP_GZIP;
+	if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f &&
+	    p[3] == 0xfd)
+		return DECOMP_ZSTD;
+
+	return DECOMP_NONE;
+}
+
+const char *decomp_name(enum decomp_format fmt)
+{
+	switch (fmt) {
+	case DECOMP_GZIP:
+		return "gzip";
+	case DECOMP_ZSTD:
+		return "zstd";
+	default:
+		return "none";
+	}
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/*
+ * Get the next piece of input in *p, returns its length, 0 at the end. A
+ * mapped input is handed over as a whole, as far as the length fits.
+ */
+static ssize_t decomp_fill(struct decomp *d, const uint8_t **p)
+{
+	size_t len = d->in_len < UINT_MAX ? d->in_len : UINT_MAX;
+	ssize_t n;
+
+	*p = d->in;
+	if (len > 0) {
+		d->in += len;
+		d->in_len -= len;
+		return len;
+	}
+	if (d->fd < 0)
+		return 0;
+
+	do
+		n = read(d->fd, d->buf, DECOMP_CHUNK_SIZE);
+	while (n < 0 && errno == EINTR);
+	*p = d->buf;
+
+	return n;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+static ssize_t gzip_read(struct decomp *d, uint8_t *buf, size_t len)
+{
+	z_stream *z = &d->z;
+	const uint8_t *p;
+	ssize_t n;
+	int ret;
+
+	z->next_out = buf;
+	z->avail_out = len < UINT_MAX ? len : UINT_MAX;
+	while (z->avail_out > 0) {
+		if (z->avail_in == 0) {
+			n = decomp_fill(d, &p);
+			if (n < 0)
+				return -1;
+			if (n == 0 && d->end)
+				break;
+			z->next_in = (uint8_t *) p;
+			z->avail_in = n;
+		}
+
+		/* without input, inflate() may still have output pending */
+		d->end = false;
+		ret = inflate(z, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			/* more input is another member as written by cat */
+			d->end = true;
+			ret = inflateReset(z);
+		}
+		if (ret == Z_MEM_ERROR) {
+			errno = ENOMEM;
+			return -1;
+		} else if (ret != Z_OK) {
+			errno = EBADMSG;
+			return -1;
+		}
+	}
+
+	return (uint8_t *) z->next_out - buf;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t zstd_read(struct decomp *d, uint8_t *buf, size_t len)
+{
+	ZSTD_outBuffer out = { buf, len, 0 };
+	const uint8_t *p;
+	size_t ret, pos;
+	ssize_t n;
+
+	while (out.pos < out.size) {
+		if (d->zin.pos == d->zin.size) {
+			n = decomp_fill(d, &p);
+			if (n < 0)
+				return -1;
+			if (n == 0 && d->end)
+				break;
+			d->zin.src = p;
+			d->zin.size = n;
+			d->zin.pos = 0;
+		}
+
+		/* successive frames are decompressed as one */
+		pos = out.pos;
+		ret = ZSTD_decompressStream(d->zd, &out, &d->zin);
+		if (ZSTD_isError(ret) ||
+		    (d->zin.size == 0 && out.pos == pos && ret != 0)) {
+			errno = EBADMSG;
+			return -1;
+		}
+		d->end = ret == 0;
+	}
+
+	return out.pos;
+}
+#endif
+
+struct decomp *decomp_open(enum decomp_format fmt, int fd,
+			   const uint8_t *in, size_t len)
+{
+	struct decomp *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->fmt = fmt;
+	d->fd = fd;
+	d->in = in;
+	d->in_len = len;
+	if (fd >= 0) {
+		d->buf = malloc(DECOMP_CHUNK_SIZE);
+		if (!d->buf || len > DECOMP_CHUNK_SIZE)
+			goto err;
+		memcpy(d->buf, in, len);
+		d->in = d->buf;
+	}
+
+	switch (fmt) {
+#ifdef HAVE_ZLIB
+	case DECOMP_GZIP:
+		/* gzip header only, 15 bits of window */
+		if (inflateInit2(&d->z, 16 + MAX_WBITS) != Z_OK)
+			goto err;
+		return d;
+#endif
+#ifdef HAVE_ZSTD
+	case DECOMP_ZSTD:
+		d->zd = ZSTD_createDStream();
+		if (!d->zd || ZSTD_isError(ZSTD_initDStream(d->zd)))
+			goto err;
+		return d;
+#endif
+	default:
+		free(d->buf);
+		free(d);
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+err:
+	decomp_close(d);
+	errno = ENOMEM;
+	return NULL;
+}
+
+ssize_t decomp_read(struct decomp *d, uint8_t *buf, size_t len)
+{
+	switch (d->fmt) {
+#ifdef HAVE_ZLIB
+	case DECOMP_GZIP:
+		return gzip_read(d, buf, len);
+#endif
+#ifdef HAVE_ZSTD
+	case DECOMP_ZSTD:
+		return zstd_read(d, buf, len);
+#endif
+	default:
+		(void) buf;
+		(void) len;
+		errno = ENOTSUP;
+		return -1;
+	}
+}
+
+void decomp_close(struct decomp *d)
+{
+	if (!d)
+		return;
+#ifdef HAVE_ZLIB
+	if (d->fmt == DECOMP_GZIP)
+		inflateEnd(&d->z);
+#endif
+#ifdef HAVE_ZSTD
+	if (d->fmt == DECOMP_ZSTD)
+		ZSTD_freeDStream(d->zd);
+#endif
+	free(d->buf);
+	free(d);
+}
@@ -0,0 +1,43 @@
+#ifndef _DECOMPRESS_H_
+#define _DECOMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* compression formats of source files, detected by their magic */
+enum decomp_format {
+	DECOMP_NONE,
+	DECOMP_GZIP,
+	DECOMP_ZSTD,
+};
+
+/* bytes needed by decomp_detect() */
+#define DECOMP_MAGIC_SIZE	4
+
+struct decomp;
+
+/*
+ * Format of the data starting with the len bytes at p. Env text never starts
+ * with the (non-printable) magic bytes, so detection is unambiguous.
+ */
+extern enum decomp_format decomp_detect(const uint8_t *p, size_t len);
+/* name of a format, e.g. for --stats */
+extern const char *decomp_name(enum decomp_format fmt);
+/*
+ * Start decompressing data of format fmt, which is the len bytes at in and,
+ * if fd isn't -1, the rest of fd. With an fd, the bytes at in are copied, so
+ * they may be the start of a file read for decomp_detect(). Returns NULL and
+ * sets errno to ENOTSUP if the format isn't supported by this build.
+ */
+extern struct decomp *decomp_open(enum decomp_format fmt, int fd,
+				  const uint8_t *in, size_t len);
+/*
+ * Decompress up to len bytes into buf, reading more input as needed. Returns
+ * less than len only at the end of the data, -1 with errno set to EBADMSG for
+ * corrupt or truncated data or as set by read().
+ */
+extern ssize_t decomp_read(struct decomp *d, uint8_t *buf, size_t len);
+extern void decomp_close(struct decomp *d);
+
+#endif /* _DECOMPRESS_H_ */
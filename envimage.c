@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "envimage.h"
+#include "convert.h"
+#include "crc32.h"
+
+/* with ENV_PARALLEL, hash payloads at least this big using multiple threads */
+#define PARALLEL_CRC_MIN_SIZE	(4 * 1024 * 1024)
+
+static void env_no_issue(void *arg, enum env_issue issue, size_t lineno,
+			 size_t col)
+{
+	(void) arg;
+	(void) issue;
+	(void) lineno;
+	(void) col;
+}
+
+ssize_t env_encode(const uint8_t *src, size_t src_len, uint8_t *dst,
+		   size_t dst_len, unsigned int flags,
+		   const struct env_encode_opts *opts)
+{
+	static const struct env_encode_opts defaults;
+	size_t hdr_size = ENV_CRC32_SIZE + (flags & ENV_REDUNDANT ? ENV_FLAGS_SIZE : 0);
+	size_t size, len, n;
+	struct env_conv c;
+	uint32_t crc = 0;
+	uint8_t *p, *end;
+
+	if (!opts)
+		opts = &defaults;
+	if (opts->pad != 0x00 && opts->pad != 0xff) {
+		errno = EINVAL;
+		return -1;
+	}
+	size = opts->size > dst_len ? opts->size : dst_len;
+	if (size < env_encoded_size(src_len, flags) || dst_len < hdr_size + src_len) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	/* CRC32 placeholder, will be filled later */
+	memset(dst, 0, ENV_CRC32_SIZE);
+	if (flags & ENV_REDUNDANT)
+		dst[ENV_CRC32_SIZE] = opts->flag;
+	p = dst + hdr_size;
+
+	/*
+	 * copy and check the text, replacing \n by \0. Unless the payload is
+	 * to be hashed in parallel, calculate the CRC32 in the same pass.
+	 */
+	memset(&c, 0, sizeof(c));
+	c.strip_cr = flags & ENV_STRIP_CR;
+	c.issue = opts->issue ? opts->issue : env_no_issue;
+	c.line = opts->line;
+	c.arg = opts->arg;
+	if (!(flags & ENV_NO_CRC) &&
+	    (!(flags & ENV_PARALLEL) || src_len < PARALLEL_CRC_MIN_SIZE))
+		len = convert_env(p, src, src_len, &c, &crc);
+	else {
+		len = convert_env(p, src, src_len, &c, NULL);
+		if (!(flags & ENV_NO_CRC))
+			crc = crc32_parallel(0, p, len);
+	}
+
+	/*
+	 * Bytes removed from the text are replaced by padding. Beyond dst_len,
+	 * the trailer and padding are up to the caller, advance the CRC32 over
+	 * them in closed form.
+	 */
+	p += len;
+	end = dst + dst_len;
+	n = (size_t) (end - p) < ENV_TRAILER_SIZE ? (size_t) (end - p) : ENV_TRAILER_SIZE;
+	memset(p, 0, n);
+	memset(p + n, opts->pad, end - p - n);
+	if (!(flags & ENV_NO_CRC)) {
+		crc = crc32_zeros(crc, ENV_TRAILER_SIZE);
+		crc = crc32_fill(crc, opts->pad, size - (p - dst) - ENV_TRAILER_SIZE);
+		env_store_crc(dst, crc, flags);
+	}
+
+	return size;
+}
+
+int env_check(const uint8_t *img, size_t len, unsigned int flags,
+	      struct env_info *info)
+{
+	const uint8_t *data = img + ENV_CRC32_SIZE + ENV_FLAGS_SIZE;
+	uint32_t (*hash)(uint32_t crc, const uint8_t *buf, size_t len) =
+		flags & ENV_PARALLEL ? crc32_parallel : crc32_update;
+	uint32_t img_crc, crc, crc_flags, crc_data;
+	size_t data_size, data_len;
+
+	if (len < ENV_CRC32_SIZE + ENV_FLAGS_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	data_size = len - ENV_CRC32_SIZE - ENV_FLAGS_SIZE;
+
+	/*
+	 * Hash the image once starting after the (possible) flags byte. The CRC
+	 * without flags byte only differs by the first data byte in front and
+	 * is derived from it using crc32_combine_len(). The hash is split at the
+	 * end of the data to get the CRC32 of the data alone as well.
+	 */
+	img_crc = env_load_crc(img, flags);
+	data_len = find_double_nul(data, data_size);
+	crc_data = hash(0, data, data_len);
+	crc_flags = hash(crc_data, data + data_len, data_size - data_len);
+	info->flags_size = 0;
+	info->flags = img[ENV_CRC32_SIZE];
+	if (flags & ENV_REDUNDANT) {
+		info->flags_size = ENV_FLAGS_SIZE;
+		info->crc_ok = img_crc == crc_flags;
+	} else {
+		crc = crc32_combine_len(crc32_update(0, img + ENV_CRC32_SIZE,
+						     ENV_FLAGS_SIZE),
+					crc_flags, data_size);
+		info->crc_ok = img_crc == crc;
+		/* unless the CRC32 matches without it, there is a flags byte */
+		if (!info->crc_ok && !(flags & ENV_NO_FLAGS)) {
+			info->flags_size = ENV_FLAGS_SIZE;
+			info->crc_ok = img_crc == crc_flags;
+		}
+	}
+
+	/* the length of the data part is given by the two terminating null bytes */
+	info->data_size = len - ENV_CRC32_SIZE - info->flags_size;
+	if (info->flags_size) {
+		info->data_len = data_len;
+		info->data_crc = crc_data;
+	} else if (img[ENV_CRC32_SIZE] == '\0' && data_size > 0 &&
+		   data[0] == '\0') {
+		/* empty, the two null bytes follow the CRC32 */
+		info->data_len = 0;
+		info->data_crc = 0;
+	} else {
+		/* the data starts one byte earlier, so does its end */
+		info->data_len = data_len + 1;
+		info->data_crc = crc32_combine_len(
+			crc32_update(0, img + ENV_CRC32_SIZE, 1), crc_data,
+			data_len);
+	}
+	info->terminated = info->data_len < info->data_size;
+
+	return 0;
+}
+
+ssize_t env_decode(const uint8_t *src, size_t src_len, uint8_t *dst,
+		   size_t dst_len, unsigned int flags, struct env_info *info)
+{
+	struct env_info ii;
+
+	if (!info)
+		info = &ii;
+	if (env_check(src, src_len, flags, info))
+		return -1;
+	if ((flags & ENV_STRICT) && (!info->crc_ok || !info->terminated)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	if (dst_len < info->data_len) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	convert(dst, src + ENV_CRC32_SIZE + info->flags_size, info->data_len,
+		'\0', '\n');
+
+	return info->data_len;
+}
+
+ssize_t env_resize(const uint8_t *src, const struct env_info *info,
+		   uint8_t *dst, size_t dst_len, unsigned int flags,
+		   const struct env_encode_opts *opts)
+{
+	static const struct env_encode_opts defaults;
+	size_t hdr_size, size, n;
+	uint8_t flag;
+	uint32_t crc;
+
+	if (!opts)
+		opts = &defaults;
+	/* info might not come from env_check(), don't read past the image */
+	if ((opts->pad != 0x00 && opts->pad != 0xff) ||
+	    (flags & ENV_SET_FLAG && flags & ENV_DROP_FLAG) ||
+	    info->flags_size > ENV_FLAGS_SIZE || info->data_len > info->data_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((flags & ENV_STRICT) && (!info->crc_ok || !info->terminated)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	flag = flags & ENV_SET_FLAG ? opts->flag : info->flags;
+	hdr_size = ENV_CRC32_SIZE + env_resized_flags_size(info, flags);
+	size = opts->size > dst_len ? opts->size : dst_len;
+	if (size < hdr_size + info->data_len + ENV_TRAILER_SIZE ||
+	    dst_len < hdr_size + info->data_len) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	/* the data may be moved in place if the flags byte comes or goes */
+	memmove(dst + hdr_size, src + ENV_CRC32_SIZE + info->flags_size,
+		info->data_len);
+	memset(dst, 0, ENV_CRC32_SIZE);
+	if (hdr_size > ENV_CRC32_SIZE)
+		dst[ENV_CRC32_SIZE] = flag;
+
+	n = dst_len - hdr_size - info->data_len;
+	n = n < ENV_TRAILER_SIZE ? n : ENV_TRAILER_SIZE;
+	memset(dst + hdr_size + info->data_len, 0, n);
+	memset(dst + hdr_size + info->data_len + n, opts->pad,
+	       dst_len - hdr_size - info->data_len - n);
+
+	/* no need to look at the data again, only the padding changes */
+	if (!(flags & ENV_NO_CRC)) {
+		crc = crc32_zeros(info->data_crc, ENV_TRAILER_SIZE);
+		crc = crc32_fill(crc, opts->pad,
+				 size - hdr_size - info->data_len - ENV_TRAILER_SIZE);
+		env_store_crc(dst, crc, flags);
+	}
+
+	return size;
+}
@@ -0,0 +1,172 @@
+#ifndef _ENVIMAGE_H_
+#define _ENVIMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Conversion of env text files to binary U-Boot environment images and back
+ * in caller supplied memory, without allocation or file I/O.
+ */
+
+/* the API of the shared library, everything else in it is hidden */
+#define ENV_EXPORT	__attribute__((visibility("default")))
+
+#define ENV_CRC32_SIZE		sizeof(uint32_t)
+/* space for active/obsolete flags in redundant environment */
+#define ENV_FLAGS_SIZE		1
+/* minimum trailing null bytes */
+#define ENV_TRAILER_SIZE	2
+
+/* flags of env_encode(), env_decode() and env_resize() */
+#define ENV_REDUNDANT	(1 << 0)	/* the image has a flags byte */
+#define ENV_NO_CRC	(1 << 1)	/* encode, resize: leave the CRC32 zero */
+#define ENV_STRIP_CR	(1 << 2)	/* encode: remove '\r' at the end of lines */
+#define ENV_STRICT	(1 << 3)	/* decode, resize: fail on a bad CRC32 or missing end */
+#define ENV_SET_FLAG	(1 << 4)	/* resize: add or set the flags byte to opts->flag */
+#define ENV_DROP_FLAG	(1 << 5)	/* resize: remove the flags byte */
+/* byte order of the CRC32, that of the host (as used by U-Boot) if neither */
+#define ENV_BIG_ENDIAN	(1 << 6)
+#define ENV_LITTLE_ENDIAN (1 << 7)
+/*
+ * encode, check: hash images of 4 MiB or more using one thread per online
+ * CPU. Starting the threads allocates their stacks and reads /sys.
+ */
+#define ENV_PARALLEL	(1 << 8)
+#define ENV_NO_FLAGS	(1 << 9)	/* check, decode: the image has no flags byte */
+
+/* problems found in env text while encoding it */
+enum env_issue {
+	ENV_ISSUE_BLANK_LINE,	/* empty line, removed */
+	ENV_ISSUE_CR,		/* '\r' in front of '\n', removed if requested */
+	ENV_ISSUE_NO_EQUALS,	/* line without '=' */
+	ENV_ISSUE_EMPTY_NAME,	/* line starting with '=' */
+};
+
+/* options of env_encode() and env_resize(), NULL for the defaults (all zero) */
+struct env_encode_opts {
+	uint8_t flag;		/* value of the flags byte with ENV_REDUNDANT */
+	uint8_t pad;		/* padding byte, 0x00 or 0xff */
+	size_t size;		/* image size if bigger than dst_len, see env_encode() */
+	/* called for each problem found, col is 1-based */
+	void (*issue)(void *arg, enum env_issue issue, size_t lineno, size_t col);
+	/* if set, called for each valid line, e.g. to find duplicates */
+	void (*line)(void *arg, const uint8_t *name, size_t name_len, size_t lineno);
+	void *arg;
+};
+
+/* result of checking an image, see env_check() */
+struct env_info {
+	size_t flags_size;
+	bool crc_ok;
+	bool terminated;	/* the data part ends with two null bytes */
+	size_t data_size;	/* size of the data part after the header */
+	size_t data_len;	/* length of the data up to the two null bytes */
+	uint32_t data_crc;	/* CRC32 over the data_len bytes */
+	uint8_t flags;		/* value of the flags byte, if any */
+};
+
+/*
+ * A variable name never starts with a non-printable character, so such a
+ * byte after the CRC32 is most likely the flags byte of a redundant env.
+ */
+static inline bool env_looks_like_flags(uint8_t c)
+{
+	return c < 0x20 || c >= 0x7f;
+}
+
+static inline bool env_big_endian(unsigned int flags)
+{
+	if (flags & (ENV_BIG_ENDIAN | ENV_LITTLE_ENDIAN))
+		return flags & ENV_BIG_ENDIAN;
+
+	return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+}
+
+/*
+ * Load and store the CRC32 of an image at p in the byte order given by flags.
+ * p needn't be aligned, e.g. with an image at an odd offset.
+ */
+static inline uint32_t env_load_crc(const uint8_t *p, unsigned int flags)
+{
+	if (env_big_endian(flags))
+		return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+		       (uint32_t) p[2] << 8 | p[3];
+
+	return (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 |
+	       (uint32_t) p[1] << 8 | p[0];
+}
+
+static inline void env_store_crc(uint8_t *p, uint32_t crc, unsigned int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < ENV_CRC32_SIZE; i++)
+		p[i] = crc >> (env_big_endian(flags) ? 24 - 8 * i : 8 * i);
+}
+
+/* size of the smallest image holding src_len bytes of text */
+static inline size_t env_encoded_size(size_t src_len, unsigned int flags)
+{
+	return ENV_CRC32_SIZE + (flags & ENV_REDUNDANT ? ENV_FLAGS_SIZE : 0) +
+	       src_len + ENV_TRAILER_SIZE;
+}
+
+/*
+ * Create the image of the env text src in dst and return its size, which is
+ * opts->size or else dst_len. The image must be at least env_encoded_size()
+ * bytes. If it is bigger than dst_len, only dst_len bytes are written, the
+ * caller is responsible for the rest, which must be zeros up to the trailer
+ * and padding bytes after it. dst_len must hold the header and the text.
+ * Returns -1 and sets errno to ENOSPC if the text doesn't fit, EINVAL for an
+ * invalid pad byte.
+ */
+extern ENV_EXPORT ssize_t env_encode(const uint8_t *src, size_t src_len,
+				     uint8_t *dst, size_t dst_len,
+				     unsigned int flags,
+				     const struct env_encode_opts *opts);
+/*
+ * Check the CRC32 of image img, detect whether it has a flags byte unless
+ * ENV_REDUNDANT or ENV_NO_FLAGS is set and find the end of the data part.
+ * There is no flags byte only if the CRC32 matches without one. Returns -1 and sets errno to
+ * EINVAL if the image is too small.
+ */
+extern ENV_EXPORT int env_check(const uint8_t *img, size_t len,
+				unsigned int flags, struct env_info *info);
+/*
+ * Extract the env text of image src into dst and return its length, info
+ * (if set) receives the result of env_check(). Returns -1 and sets errno to
+ * ENOSPC if dst_len is too small for the text, EBADMSG with ENV_STRICT if the
+ * CRC32 is bad or the data isn't terminated, or as env_check().
+ */
+extern ENV_EXPORT ssize_t env_decode(const uint8_t *src, size_t src_len,
+				     uint8_t *dst, size_t dst_len,
+				     unsigned int flags, struct env_info *info);
+/* size of the flags byte of the image created by env_resize() */
+static inline size_t env_resized_flags_size(const struct env_info *info,
+					    unsigned int flags)
+{
+	if (flags & ENV_SET_FLAG)
+		return ENV_FLAGS_SIZE;
+
+	return flags & ENV_DROP_FLAG ? 0 : info->flags_size;
+}
+
+/*
+ * Copy the data of image src into a new image of a different size in dst,
+ * which may be the same buffer, without converting it to text. info is the
+ * result of env_check() on src. The flags byte of src is kept unless
+ * ENV_SET_FLAG or ENV_DROP_FLAG is given, the sizes and the padding are as
+ * for env_encode(). The CRC32 of the data is taken from info and extended
+ * over the new padding. Returns the size of the image or -1 with errno set
+ * as for env_encode() and env_decode(), or to EINVAL if info doesn't describe
+ * a valid image.
+ */
+extern ENV_EXPORT ssize_t env_resize(const uint8_t *src,
+				     const struct env_info *info, uint8_t *dst,
+				     size_t dst_len, unsigned int flags,
+				     const struct env_encode_opts *opts);
+
+#endif /* _ENVIMAGE_H_ */
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "envindex.h"
+
+/* FNV-1a, variable names are short */
+static uint32_t env_hash(const uint8_t *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *name++) * 16777619u;
+
+	return h;
+}
+
+void env_index_init(struct env_index *idx)
+{
+	memset(idx, 0, sizeof(*idx));
+}
+
+void env_index_free(struct env_index *idx)
+{
+	free(idx->vars);
+	free(idx->slots);
+	env_index_init(idx);
+}
+
+static size_t env_index_slot(const struct env_index *idx, const uint8_t *name,
+			     size_t name_len, uint32_t hash)
+{
+	size_t mask = idx->nslots - 1, i;
+	const struct env_var *v;
+
+	for (i = hash & mask; idx->slots[i]; i = (i + 1) & mask) {
+		v = &idx->vars[idx->slots[i] - 1];
+		if (v->hash == hash && v->name_len == name_len &&
+		    memcmp(v->name, name, name_len) == 0)
+			break;
+	}
+
+	return i;
+}
+
+/* keep the hash table at most half full */
+static int env_index_grow(struct env_index *idx)
+{
+	uint32_t *slots;
+	size_t nslots = idx->nslots ? 2 * idx->nslots : 64, i, j;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots)
+		return -1;
+
+	free(idx->slots);
+	idx->slots = slots;
+	idx->nslots = nslots;
+	for (i = 0; i < idx->nvars; i++) {
+		for (j = idx->vars[i].hash & (nslots - 1); slots[j]; j = (j + 1) & (nslots - 1))
+			;
+		slots[j] = i + 1;
+	}
+
+	return 0;
+}
+
+struct env_var *env_index_find(const struct env_index *idx,
+			       const uint8_t *name, size_t name_len)
+{
+	size_t i;
+
+	if (idx->nvars == 0)
+		return NULL;
+
+	i = env_index_slot(idx, name, name_len, env_hash(name, name_len));
+	return idx->slots[i] ? &idx->vars[idx->slots[i] - 1] : NULL;
+}
+
+struct env_var *env_index_set(struct env_index *idx,
+			      const uint8_t *name, size_t name_len,
+			      const uint8_t *value, size_t value_len)
+{
+	uint32_t hash = env_hash(name, name_len);
+	struct env_var *v;
+	size_t i;
+
+	if (2 * (idx->nvars + 1) > idx->nslots && env_index_grow(idx))
+		return NULL;
+
+	i = env_index_slot(idx, name, name_len, hash);
+	if (idx->slots[i]) {
+		v = &idx->vars[idx->slots[i] - 1];
+	} else {
+		if (idx->nvars == idx->vars_size) {
+			size_t size = idx->vars_size ? 2 * idx->vars_size : 32;
+
+			v = realloc(idx->vars, size * sizeof(*v));
+			if (!v)
+				return NULL;
+			idx->vars = v;
+			idx->vars_size = size;
+		}
+		v = &idx->vars[idx->nvars];
+		v->name = name;
+		v->name_len = name_len;
+		v->hash = hash;
+		idx->slots[i] = ++idx->nvars;
+	}
+
+	v->value = value;
+	v->value_len = value_len;
+
+	return v;
+}
+
+int env_index_parse(struct env_index *idx, const uint8_t *buf, size_t len,
+		    uint8_t sep, bool empty_deletes)
+{
+	const uint8_t *end = buf + len, *line, *eol, *eq;
+
+	for (line = buf; line < end; line = eol + 1) {
+		eol = memchr(line, sep, end - line);
+		if (!eol)
+			eol = end;
+
+		eq = memchr(line, '=', eol - line);
+		if (!eq || eq == line)
+			continue;
+
+		if (!env_index_set(idx, line, eq - line,
+				   (empty_deletes && eq + 1 == eol) ? NULL : eq + 1,
+				   eol - (eq + 1)))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* byte d of the name of v as radix, 0 past its end so that prefixes go first */
+static inline size_t env_var_radix(const struct env_var *v, size_t d)
+{
+	return d < v->name_len ? (size_t) v->name[d] + 1 : 0;
+}
+
+/*
+ * LSD radix sort, one counting sort pass per byte position from the last one
+ * of the longest name to the first, alternating between vars and tmp. Passes
+ * in which all names have the same byte are skipped.
+ */
+void env_var_sort(const struct env_var **vars, size_t n,
+		  const struct env_var **tmp)
+{
+	const struct env_var **src = vars, **dst = tmp, **t;
+	size_t count[257], max_len = 0, sum, k, i, d;
+
+	if (n < 2)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (vars[i]->name_len > max_len)
+			max_len = vars[i]->name_len;
+	}
+
+	for (d = max_len; d-- > 0; ) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[env_var_radix(src[i], d)]++;
+		if (count[env_var_radix(src[0], d)] == n)
+			continue;
+
+		for (sum = 0, k = 0; k < 257; k++) {
+			i = count[k];
+			count[k] = sum;
+			sum += i;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[env_var_radix(src[i], d)]++] = src[i];
+		t = src;
+		src = dst;
+		dst = t;
+	}
+
+	if (src != vars)
+		memcpy(vars, src, n * sizeof(*vars));
+}
@@ -0,0 +1,56 @@
+#ifndef _ENVINDEX_H_
+#define _ENVINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* one "name=value" record, pointing into the buffer it was parsed from */
+struct env_var {
+	const uint8_t *name;
+	size_t name_len;
+	const uint8_t *value;	/* NULL if the variable is to be deleted */
+	size_t value_len;
+	uint32_t hash;
+};
+
+/*
+ * Index of variables, in the order of their first definition, with an open
+ * addressed hash table over the variable names for lookup.
+ */
+struct env_index {
+	struct env_var *vars;
+	size_t nvars;
+	size_t vars_size;
+	uint32_t *slots;	/* index + 1 into vars, 0 for an empty slot */
+	size_t nslots;		/* power of two */
+};
+
+extern void env_index_init(struct env_index *idx);
+extern void env_index_free(struct env_index *idx);
+
+extern struct env_var *env_index_find(const struct env_index *idx,
+				      const uint8_t *name, size_t name_len);
+/*
+ * Define a variable, replacing the value of an existing definition in place.
+ * A NULL value marks the variable as deleted. Returns NULL if out of memory.
+ */
+extern struct env_var *env_index_set(struct env_index *idx,
+				     const uint8_t *name, size_t name_len,
+				     const uint8_t *value, size_t value_len);
+/*
+ * Add all "name=value" records separated by sep in buf, later definitions
+ * replace earlier ones. Records without '=' or with an empty name are
+ * skipped. If empty_deletes is set, "name=" marks name as deleted. Returns
+ * -1 if out of memory.
+ */
+extern int env_index_parse(struct env_index *idx, const uint8_t *buf,
+			   size_t len, uint8_t sep, bool empty_deletes);
+/*
+ * Sort n variables by name, bytewise as strcmp() would, using a stable radix
+ * sort over the names. tmp must have room for n entries.
+ */
+extern void env_var_sort(const struct env_var **vars, size_t n,
+			 const struct env_var **tmp);
+
+#endif /* _ENVINDEX_H_ */
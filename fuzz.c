@@ -0,0 +1,312 @@
+/*
+ * envfuzz -- fuzzing harness of the decode path of libmkubootenv, for
+ * libFuzzer or, built with -DFUZZ_MAIN, AFL and replaying inputs. See
+ * "make fuzz".
+ *
+ * The first two bytes of an input select the flags, the kernels and the
+ * size to resize to, the rest is the image, which is checked, decoded and
+ * resized. Each result is compared with the one of the scalar kernels and
+ * the images created are checked again. The image is also encoded as text.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "convert.h"
+#include "crc32.h"
+#include "envimage.h"
+
+/* bits of the first input byte */
+#define FUZZ_REDUNDANT		(1 << 0)	/* pass ENV_REDUNDANT */
+#define FUZZ_BIG_ENDIAN		(1 << 1)
+#define FUZZ_PAD		(1 << 2)	/* pad with 0xff */
+#define FUZZ_SET_FLAG		(1 << 3)
+#define FUZZ_DROP_FLAG		(1 << 4)
+#define FUZZ_STRIP_CR		(1 << 5)
+/* the top two bits select the kernels */
+#define FUZZ_KERNEL_SHIFT	6
+
+#define FUZZ_HDR_SIZE		2
+
+#define fuzz_assert(cond)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: assertion '%s' failed\n",\
+				__FILE__, __LINE__, #cond);		\
+			abort();					\
+		}							\
+	} while (0)
+
+extern int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* use the n-th of the built in kernels (or the last one), n = 0 is scalar */
+static void fuzz_select(const char *const *kernels, int (*select)(const char *),
+			unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; kernels[i]; i++) {
+		if (i <= n)
+			select(kernels[i]);
+	}
+}
+
+static void fuzz_kernels(unsigned int n)
+{
+	fuzz_select(crc32_kernels, crc32_select, n);
+	fuzz_select(convert_kernels, convert_select, n);
+}
+
+/*
+ * There is a flags byte unless the CRC32 matches without one, with
+ * ENV_NO_FLAGS there is none either way.
+ */
+static void fuzz_check_flags(const uint8_t *img, size_t len, unsigned int flags,
+			     const struct env_info *ii)
+{
+	uint32_t img_crc = env_load_crc(img, flags);
+	const uint8_t *p = img + ENV_CRC32_SIZE;
+	bool no_flags_ok = img_crc == crc32_update(0, p, len - ENV_CRC32_SIZE);
+	struct env_info nf;
+
+	fuzz_assert(env_check(img, len, flags | ENV_NO_FLAGS, &nf) == 0 &&
+		    nf.flags_size == 0 && nf.crc_ok == no_flags_ok);
+	if (no_flags_ok)
+		fuzz_assert(ii->flags_size == 0 && ii->crc_ok &&
+			    ii->data_len == nf.data_len &&
+			    ii->data_crc == nf.data_crc);
+	else
+		fuzz_assert(ii->flags_size == ENV_FLAGS_SIZE &&
+			    ii->crc_ok == (img_crc ==
+					   crc32_update(0, p + ENV_FLAGS_SIZE,
+							len - ENV_CRC32_SIZE -
+							ENV_FLAGS_SIZE)));
+}
+
+static void fuzz_check(const uint8_t *img, size_t len, unsigned int flags,
+		       unsigned int kernel, struct env_info *ii)
+{
+	struct env_info ref;
+	int ret;
+
+	fuzz_kernels(kernel);
+	ret = env_check(img, len, flags, ii);
+	fuzz_kernels(0);
+	fuzz_assert((env_check(img, len, flags, &ref) == 0) == (ret == 0));
+	if (ret) {
+		fuzz_assert(len < ENV_CRC32_SIZE + ENV_FLAGS_SIZE && errno == EINVAL);
+		return;
+	}
+
+	fuzz_assert(ii->flags_size == ref.flags_size && ii->crc_ok == ref.crc_ok &&
+		    ii->terminated == ref.terminated &&
+		    ii->data_size == ref.data_size && ii->data_len == ref.data_len &&
+		    ii->data_crc == ref.data_crc && ii->flags == ref.flags);
+	fuzz_assert(ii->flags_size <= ENV_FLAGS_SIZE);
+	fuzz_assert(ENV_CRC32_SIZE + ii->flags_size + ii->data_size == len);
+	fuzz_assert(ii->data_len <= ii->data_size);
+	fuzz_assert(ii->data_len ==
+		    find_double_nul(img + ENV_CRC32_SIZE + ii->flags_size,
+				    ii->data_size));
+	fuzz_assert(ii->terminated == (ii->data_len < ii->data_size));
+	fuzz_assert(ii->data_crc ==
+		    crc32_update(0, img + ENV_CRC32_SIZE + ii->flags_size,
+				 ii->data_len));
+	if (flags & ENV_REDUNDANT)
+		fuzz_assert(ii->flags_size == ENV_FLAGS_SIZE);
+	else
+		fuzz_check_flags(img, len, flags, ii);
+}
+
+static void fuzz_decode(const uint8_t *img, size_t len, unsigned int flags,
+			const struct env_info *ii)
+{
+	uint8_t *dst;
+	ssize_t ret;
+
+	/* exactly as big as needed, so that any overflow is caught */
+	dst = malloc(ii->data_len > 0 ? ii->data_len : 1);
+	fuzz_assert(dst);
+	ret = env_decode(img, len, dst, ii->data_len, flags, NULL);
+	fuzz_assert(ret == (ssize_t) ii->data_len);
+	fuzz_assert(!memchr(dst, '\0', ii->data_len));
+
+	ret = env_decode(img, len, dst, ii->data_len, flags | ENV_STRICT, NULL);
+	if (ii->crc_ok && ii->terminated)
+		fuzz_assert(ret == (ssize_t) ii->data_len);
+	else
+		fuzz_assert(ret < 0 && errno == EBADMSG);
+
+	if (ii->data_len > 0) {
+		ret = env_decode(img, len, dst, ii->data_len - 1, flags, NULL);
+		fuzz_assert(ret < 0 && errno == ENOSPC);
+	}
+	free(dst);
+}
+
+static void fuzz_resize(const uint8_t *img, size_t len, unsigned int flags,
+			const struct env_info *ii, uint8_t ctl, uint8_t extra)
+{
+	struct env_encode_opts opts = {
+		.flag = 1,
+		.pad = ctl & FUZZ_PAD ? 0xff : 0x00,
+	};
+	struct env_info out;
+	size_t size, dst_len;
+	uint8_t *dst, *in_place;
+	ssize_t ret;
+
+	flags &= ENV_BIG_ENDIAN | ENV_LITTLE_ENDIAN;
+	if (ctl & FUZZ_SET_FLAG)
+		flags |= ENV_SET_FLAG;
+	if (ctl & FUZZ_DROP_FLAG)
+		flags |= ENV_DROP_FLAG;
+	size = ENV_CRC32_SIZE + env_resized_flags_size(ii, flags) + ii->data_len +
+	       ENV_TRAILER_SIZE + 16 * (extra & 0x7f);
+	/* only the data is written with the rest left to the caller */
+	dst_len = extra & 0x80 ? size - ENV_TRAILER_SIZE - 16 * (extra & 0x7f) : size;
+
+	dst = malloc(size);
+	fuzz_assert(dst);
+	opts.size = size;
+	ret = env_resize(img, ii, dst, dst_len, flags, &opts);
+	if ((flags & ENV_SET_FLAG) && (flags & ENV_DROP_FLAG)) {
+		fuzz_assert(ret < 0 && errno == EINVAL);
+		free(dst);
+		return;
+	}
+	fuzz_assert(ret == (ssize_t) size);
+	if (dst_len < size) {
+		memset(dst + dst_len, 0, ENV_TRAILER_SIZE);
+		memset(dst + dst_len + ENV_TRAILER_SIZE, opts.pad,
+		       size - dst_len - ENV_TRAILER_SIZE);
+	}
+
+	fuzz_check(dst, size, (flags & (ENV_BIG_ENDIAN | ENV_LITTLE_ENDIAN)) |
+		   (env_resized_flags_size(ii, flags) ? ENV_REDUNDANT : 0), 0, &out);
+	fuzz_assert(out.crc_ok && out.terminated);
+	fuzz_assert(out.data_crc == ii->data_crc || out.data_len < ii->data_len);
+
+	/* an info which doesn't fit an image is rejected */
+	out = *ii;
+	out.data_len = out.data_size + 1;
+	ret = env_resize(img, &out, dst, dst_len, flags & ~ENV_DROP_FLAG, &opts);
+	fuzz_assert(ret < 0 && errno == EINVAL);
+
+	/* in place, with the image at the start of the buffer */
+	if (dst_len == size) {
+		in_place = malloc(len > size ? len : size);
+		fuzz_assert(in_place);
+		memcpy(in_place, img, len);
+		ret = env_resize(in_place, ii, in_place, size, flags, &opts);
+		fuzz_assert(ret == (ssize_t) size && memcmp(in_place, dst, size) == 0);
+		free(in_place);
+	}
+	free(dst);
+}
+
+/* encode the image as if it was text */
+static void fuzz_encode(const uint8_t *text, size_t len, unsigned int flags)
+{
+	struct env_encode_opts opts = { .flag = 1 };
+	struct env_info ii;
+	size_t size = env_encoded_size(len, flags);
+	uint8_t *dst;
+	ssize_t ret;
+
+	dst = malloc(size);
+	fuzz_assert(dst);
+	ret = env_encode(text, len, dst, size, flags, &opts);
+	fuzz_assert(ret == (ssize_t) size);
+	fuzz_check(dst, size, flags & ~ENV_STRIP_CR, 0, &ii);
+	fuzz_assert(ii.crc_ok && ii.terminated);
+
+	ret = env_encode(text, len, dst, size - 1, flags, &opts);
+	fuzz_assert(ret < 0 && errno == ENOSPC);
+	free(dst);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const uint8_t *img = data + FUZZ_HDR_SIZE;
+	size_t len = size - FUZZ_HDR_SIZE;
+	unsigned int flags;
+	struct env_info ii;
+	uint8_t ctl;
+
+	if (size < FUZZ_HDR_SIZE)
+		return 0;
+	ctl = data[0];
+	flags = (ctl & FUZZ_REDUNDANT ? ENV_REDUNDANT : 0) |
+		(ctl & FUZZ_BIG_ENDIAN ? ENV_BIG_ENDIAN : ENV_LITTLE_ENDIAN);
+
+	fuzz_check(img, len, flags, ctl >> FUZZ_KERNEL_SHIFT, &ii);
+	if (len >= ENV_CRC32_SIZE + ENV_FLAGS_SIZE) {
+		fuzz_decode(img, len, flags, &ii);
+		fuzz_resize(img, len, flags, &ii, ctl, data[1]);
+	}
+
+	fuzz_kernels(ctl >> FUZZ_KERNEL_SHIFT);
+	fuzz_encode(img, len, flags | (ctl & FUZZ_STRIP_CR ? ENV_STRIP_CR : 0));
+
+	return 0;
+}
+
+#ifdef FUZZ_MAIN
+/* run each input file (or stdin) once, e.g. for AFL or to replay a crash */
+static int fuzz_file(const char *name)
+{
+	FILE *fp = strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+	uint8_t *buf = NULL, *p;
+	size_t len = 0, size = 0, n;
+
+	if (!fp) {
+		fprintf(stderr, "envfuzz: Can't open '%s'\n", name);
+		return -1;
+	}
+	do {
+		if (len == size) {
+			size = size ? 2 * size : 4096;
+			p = realloc(buf, size);
+			if (!p) {
+				free(buf);
+				return -1;
+			}
+			buf = p;
+		}
+		n = fread(buf + len, 1, size - len, fp);
+		len += n;
+	} while (n > 0);
+	if (fp != stdin)
+		fclose(fp);
+
+	/* an exactly sized copy, so that reading past the end is caught */
+	p = malloc(len + !len);
+	if (p) {
+		memcpy(p, buf, len);
+		LLVMFuzzerTestOneInput(p, len);
+	}
+	free(p);
+	free(buf);
+
+	return p ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret = 0;
+
+	if (argc < 2)
+		return fuzz_file("-") ? EXIT_FAILURE : EXIT_SUCCESS;
+	for (i = 1; i < argc; i++) {
+		if (fuzz_file(argv[i]))
+			ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
+#endif
@@ -20,48 +20,179 @@
  * MA 02110-1301, USA.
  */
 
+#define _GNU_SOURCE		/* for fallocate() and copy_file_range() */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
 
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <mtd/mtd-user.h>
+#include <linux/fs.h>
 
+#include "convert.h"
 #include "crc32.h"
+#include "decompress.h"
+#include "envimage.h"
+#include "envindex.h"
+#include "xxh64.h"
 
 #undef DEBUG
 
 #define CMD_NAME		"mkubootenv"
 
-#define CRC32_SIZE		sizeof(uint32_t)
-/* space for active/obsolete flags in redundant environment */
-#define FLAGS_SIZE		1
-/* minimum trailing null bytes */
-#define TRAILER_SIZE		2
+#define CRC32_SIZE		ENV_CRC32_SIZE
+#define FLAGS_SIZE		ENV_FLAGS_SIZE
+#define TRAILER_SIZE		ENV_TRAILER_SIZE
+/*
+ * mmap regular target files if at least this many bytes need to be written,
+ * otherwise write them from a buffer
+ */
+#define MMAP_MIN_SIZE		(1024 * 1024)
+#ifndef FICLONE
+# define FICLONE		_IOW(0x94, 9, int)
+#endif
+/* chunk size for reading sources which can't be mapped */
+#define STREAM_CHUNK_SIZE	(64 * 1024)
 
 #define err(fmt, args...)	fprintf(stderr, "%s: Error: " fmt, CMD_NAME, ##args)
 #define warn(fmt, args...)	fprintf(stderr, "%s: Warning: " fmt, CMD_NAME, ##args)
+#define info(fmt, args...)	fprintf(stderr, "%s: " fmt, CMD_NAME, ##args)
 #ifdef DEBUG
 # define dbg(fmt, args...)	fprintf(stdout, fmt, ##args)
 #else
 # define dbg(fmt, args...)
 #endif
 
+/* reusable buffer, e.g. shared by the buffered targets of a batch worker */
+struct buffer {
+	uint8_t *ptr;
+	size_t size;
+};
+
 /* file "object" */
 struct file {
 	const char *name;
 	int fd;
 	uint8_t *ptr;
 	size_t size;
+	size_t map_size;	/* size of the mapping at ptr, at most size */
+	bool buffered;		/* ptr is a buffer to be written on flush */
+	bool regular;		/* regular file, i.e. can be mapped and truncated */
+	struct buffer *buf;	/* if set, backs ptr of a buffered file */
+	off_t offset;		/* offset of the image in the file */
+	bool keep;		/* write in place, don't truncate the file */
+	size_t map_delta;	/* from the page aligned start of the mapping to ptr */
+	uint8_t pad;		/* padding byte of binary images, 0x00 or 0xff */
+	bool mtd;		/* MTD character device, see uboot_env_flush_mtd() */
+	bool update;		/* only rewrite changed blocks, see uboot_env_flush_update() */
+	struct mtd_info_user mtd_info;
+	enum decomp_format compressed;	/* compressed source, which is streamed */
+	size_t nwarnings;	/* about the source, which isn't cached then */
+};
+
+/* options for the conversion of one source/target pair */
+struct env_opts {
+	size_t img_size;
+	uint8_t flags;
+	size_t flags_size;
+	bool reverse;
+	bool redundant;
+	bool do_crc;
+	const char **overlays;	/* overlay env files merged into the source */
+	size_t noverlays;
+	off_t offset;		/* offset of the binary image in its file */
+	bool in_place;		/* offset given, write into the existing file */
+	uint8_t pad;		/* padding byte of binary images */
+	bool update;		/* only rewrite the changed blocks of the target */
+	bool verify;		/* only check the source image */
+	bool strip_cr;		/* remove carriage returns at the end of lines */
+	bool duplicates;	/* warn about variables defined more than once */
+	bool resize;		/* convert a binary image into one of another size */
+	bool no_flag;		/* remove the flags byte when resizing */
+	unsigned int endian;	/* ENV_BIG_ENDIAN or ENV_LITTLE_ENDIAN, 0 for the host's */
+	const char *cache_dir;	/* cache of target files, see uboot_env_cache_key() */
+	bool scan;		/* find the images in flash dumps, see uboot_env_scan() */
+	bool canonical;		/* sort the variables by name, see uboot_env_merge() */
+	off_t offset_b;		/* offset of <slot B> if set, see uboot_env_write_slots() */
+	bool sync;		/* fsync the target after writing it */
+	size_t align;		/* alignment of the images found by --scan */
+};
+
+/* source file checks done while converting, see convert_env() */
+struct env_check {
+	const char *name;
+	bool strip_cr;
+	struct env_index names;	/* variables seen so far if finding duplicates */
+	size_t nwarnings;
+};
+
+/* parsed base environment, shared by all conversions using it with overlays */
+struct base_env {
+	struct base_env *next;
+	struct file f;
+	struct env_index idx;
+};
+
+/* output of --stats */
+#define STATS_TEXT		1
+#define STATS_JSON		2
+
+/* phases of a conversion timed with --stats */
+enum stats_phase {
+	STAT_SOURCE,		/* open, stat and map the source, merge overlays */
+	STAT_CACHE,		/* hash the source, copy from or into the cache */
+	STAT_TARGET,		/* open, extend and map or allocate the target */
+	STAT_CHECK,		/* check the CRC32 of binary sources */
+	STAT_CONVERT,		/* convert and hash, all of it when streaming */
+	STAT_FLUSH,		/* write buffered targets and padding, unmap */
+	NR_STAT_PHASES,
+};
+
+static const char *const stat_phase_names[NR_STAT_PHASES] = {
+	"source", "cache", "target", "check", "convert", "flush",
 };
 
+/* timings and counters of one conversion, see stats_phase() */
+struct env_stats {
+	uint64_t ns[NR_STAT_PHASES];
+	long minflt[NR_STAT_PHASES];	/* page faults */
+	long majflt[NR_STAT_PHASES];
+	size_t bytes_in;
+	size_t bytes_out;
+	const char *source_backend;
+	const char *target_backend;
+	/* start of the current phase */
+	uint64_t mark_ns;
+	long mark_minflt;
+	long mark_majflt;
+};
+
+static struct base_env *base_envs;
+static pthread_mutex_t base_envs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* source of padding for buffered writes */
+static const uint8_t zero_buf[64 * 1024];
+static const uint8_t ff_buf[sizeof(zero_buf)] = { [0 ... sizeof(zero_buf) - 1] = 0xff };
+
 static void usage_and_exit(int status) __attribute__((noreturn));
+static int write_padded(int fd, const uint8_t *buf, size_t len, size_t pad,
+			uint8_t fill);
 
 static inline void uboot_env_init_file(struct file *f)
 {
@@ -69,11 +200,126 @@ static inline void uboot_env_init_file(struct file *f)
 	f->ptr = MAP_FAILED;
 }
 
+static inline bool is_stdio(const char *name)
+{
+	return strcmp(name, "-") == 0;
+}
+
+static void stats_now(uint64_t *ns, long *minflt, long *majflt)
+{
+	struct timespec ts;
+	struct rusage ru;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	*ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	/* per thread, batch workers run side by side */
+	if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+		*minflt = ru.ru_minflt;
+		*majflt = ru.ru_majflt;
+	}
+}
+
+static void stats_start(struct env_stats *st)
+{
+	if (!st)
+		return;
+	memset(st, 0, sizeof(*st));
+	stats_now(&st->mark_ns, &st->mark_minflt, &st->mark_majflt);
+}
+
+/* account the time and page faults since the last call to phase */
+static void stats_phase(struct env_stats *st, enum stats_phase phase)
+{
+	uint64_t ns;
+	long minflt, majflt;
+
+	if (!st)
+		return;
+	minflt = st->mark_minflt;
+	majflt = st->mark_majflt;
+	stats_now(&ns, &minflt, &majflt);
+	st->ns[phase] += ns - st->mark_ns;
+	st->minflt[phase] += minflt - st->mark_minflt;
+	st->majflt[phase] += majflt - st->mark_majflt;
+	st->mark_ns = ns;
+	st->mark_minflt = minflt;
+	st->mark_majflt = majflt;
+}
+
+static uint64_t stats_total_ns(const struct env_stats *st)
+{
+	uint64_t ns = 0;
+	unsigned int i;
+
+	for (i = 0; i < NR_STAT_PHASES; i++)
+		ns += st->ns[i];
+
+	return ns;
+}
+
+/*
+ * Map len bytes of file f at f->offset, which need not be page aligned.
+ * Returns the pointer to the data at f->offset.
+ */
+static uint8_t *uboot_env_mmap(struct file *f, size_t len, int prot)
+{
+	size_t delta = f->offset & (sysconf(_SC_PAGESIZE) - 1);
+	uint8_t *p;
+
+	/* mapping 0 bytes fails, e.g. for an empty source */
+	p = mmap(NULL, delta + (len > 0 ? len : 1), prot, MAP_SHARED, f->fd,
+		 f->offset - delta);
+	if (p == MAP_FAILED)
+		return MAP_FAILED;
+
+	f->map_delta = delta;
+	f->map_size = len > 0 ? len : 1;
+
+	return p + delta;
+}
+
+/*
+ * Skip len bytes of the input fd, reading them if it isn't seekable.
+ */
+static int skip_input(int fd, off_t len)
+{
+	char buf[4096];
+	ssize_t n;
+
+	if (lseek(fd, len, SEEK_CUR) >= 0)
+		return 0;
+	if (errno != ESPIPE)
+		return -1;
+
+	while (len > 0) {
+		n = read(fd, buf, len < (off_t) sizeof(buf) ? (size_t) len : sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EINVAL;
+			return -1;
+		}
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Open and map the source file, starting at s->offset and limited to s->size
+ * bytes if set. Sources which can't be mapped, i.e. stdin ("-"), pipes and
+ * character devices, are left unmapped with s->regular unset and need to be
+ * read using the streaming functions.
+ */
 static int uboot_env_prepare_source(struct file *s)
 {
 	struct stat sbuf;
 
-	s->fd = open(s->name, O_RDONLY);
+	if (is_stdio(s->name))
+		s->fd = STDIN_FILENO;
+	else
+		s->fd = open(s->name, O_RDONLY);
 	if (s->fd < 0) {
 		err("Can't open source file '%s': %s\n", s->name,
 				strerror(errno));
@@ -87,7 +333,28 @@ static int uboot_env_prepare_source(struct file *s)
 		return -1;
 	}
 
-	s->ptr = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, s->fd, 0);
+	s->regular = S_ISREG(sbuf.st_mode);
+	if (!s->regular) {
+		if (s->offset > 0 && skip_input(s->fd, s->offset) < 0) {
+			err("Can't seek in source file '%s': %s\n", s->name,
+					strerror(errno));
+			close(s->fd);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (s->offset > sbuf.st_size ||
+	    s->size > (size_t) (sbuf.st_size - s->offset)) {
+		err("Source file '%s' is too small for the given offset and size\n",
+				s->name);
+		close(s->fd);
+		return -1;
+	}
+	if (s->size == 0)
+		s->size = sbuf.st_size - s->offset;
+
+	s->ptr = uboot_env_mmap(s, s->size, PROT_READ);
 	if (s->ptr == MAP_FAILED) {
 		err("Can't mmap source image file '%s': %s\n", s->name,
 				strerror(errno));
@@ -95,273 +362,3211 @@ static int uboot_env_prepare_source(struct file *s)
 		return -1;
 	}
 
-	s->size = sbuf.st_size;
-
 	return 0;
 }
 
-static int uboot_env_prepare_target(struct file *t)
+/*
+ * Open the target file and seek to t->offset. stdout ("-") and targets to be
+ * written in place or updated are never truncated.
+ */
+static int uboot_env_open_target(struct file *t)
 {
-	t->fd = open(t->name, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	struct stat sbuf;
+
+	if (is_stdio(t->name))
+		t->fd = STDOUT_FILENO;
+	else
+		t->fd = open(t->name, O_RDWR|O_CREAT|(t->keep || t->update ? 0 : O_TRUNC),
+			     0666);
 	if (t->fd < 0) {
 		err("Can't open target image file '%s': %s\n", t->name,
 				strerror(errno));
 		return -1;
 	}
 
-	/*
-	 * seek to the end of the target file to write a byte, so we have the
-	 * whole target image size mapped for writing
-	 */
-	if (lseek(t->fd, t->size - 1, SEEK_SET) < 0) {
-		err("Can't seek in target image file '%s': %s\n", t->name,
+	if (fstat(t->fd, &sbuf) < 0) {
+		err("Can't stat target image file '%s': %s\n", t->name,
 				strerror(errno));
 		close(t->fd);
 		return -1;
 	}
+	t->regular = S_ISREG(sbuf.st_mode) && !is_stdio(t->name);
+	t->mtd = S_ISCHR(sbuf.st_mode) &&
+		 ioctl(t->fd, MEMGETINFO, &t->mtd_info) == 0 &&
+		 t->mtd_info.erasesize > 0;
+	/* there is nothing to compare against in stdout or a pipe */
+	if (t->update && (is_stdio(t->name) || lseek(t->fd, 0, SEEK_CUR) < 0))
+		t->update = false;
 
-	if (write(t->fd, "", 1) < 0) {
-		err("Can't write to target image file '%s': %s\n", t->name,
+	if (t->offset > 0 && lseek(t->fd, t->offset, SEEK_SET) < 0) {
+		err("Can't seek in target image file '%s': %s\n", t->name,
 				strerror(errno));
 		close(t->fd);
 		return -1;
 	}
 
-	t->ptr = mmap(NULL, t->size, PROT_READ|PROT_WRITE, MAP_SHARED, t->fd, 0);
-	if (t->ptr == MAP_FAILED) {
-		err("Can't mmap target image file '%s': %s\n", t->name,
-				strerror(errno));
-		close(t->fd);
+	return 0;
+}
+
+/* make sure the regular target file extends up to the end of the image */
+static int uboot_env_extend_target(struct file *t)
+{
+	struct stat sbuf;
+
+	if (fstat(t->fd, &sbuf) < 0)
 		return -1;
-	}
+	if (sbuf.st_size < (off_t) (t->offset + t->size))
+		return ftruncate(t->fd, t->offset + t->size);
 
 	return 0;
 }
 
-static void uboot_env_cleanup_file(struct file *f)
+/*
+ * Write len bytes of padding at off in the regular target file. Unless it is
+ * written in place, the target has been truncated and zero padding is a
+ * sparse run of zeros already.
+ */
+static int uboot_env_pad_target(struct file *t, off_t off, size_t len)
 {
-	if (f->ptr != MAP_FAILED)
-		munmap(f->ptr, f->size);
-	if (f->fd > 0)
-		close(f->fd);
+	if (len == 0 || (t->pad == 0 && !t->keep))
+		return 0;
+
+	if (t->pad == 0 &&
+	    fallocate(t->fd, FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE, off, len) == 0)
+		return 0;
+
+	/* not supported by the filesystem or not zeros, write the padding */
+	if (lseek(t->fd, off, SEEK_SET) < 0)
+		return -1;
+	return write_padded(t->fd, NULL, 0, len, t->pad);
 }
 
-static void uboot_env_to_img(struct file *s, struct file *t, uint8_t flags,
-			     size_t flags_size, bool do_crc)
+/* make sure the buffer of target t holds at least size bytes, keeping its data */
+static int uboot_env_grow_target(struct file *t, size_t size)
 {
-	uint8_t *p, *q, *end;
-
-	dbg("source file (env):       %s\n", s->name);
-	dbg("target image file (bin): %s\n", t->name);
-	dbg("target size:             %zd\n", t->size);
+	uint8_t *p;
 
-	/* CRC32 placeholder, will be filled later */
-	end = t->ptr + CRC32_SIZE;
-	for (p = t->ptr; p < end; p++)
-		*p = 0;
+	if (size == 0)
+		size = 1;
 
-	/* set flags if the redundant environment option is set */
-	if (flags_size > 0) {
-		*p = flags;
-		p++;
+	if (t->buf) {
+		if (t->buf->size < size) {
+			p = realloc(t->buf->ptr, size);
+			if (!p)
+				goto nomem;
+			t->buf->ptr = p;
+			t->buf->size = size;
+		}
+		t->ptr = t->buf->ptr;
+	} else {
+		p = realloc(t->buffered ? t->ptr : NULL, size);
+		if (!p)
+			goto nomem;
+		t->ptr = p;
 	}
+	t->buffered = true;
+
+	return 0;
+
+nomem:
+	err("Can't allocate buffer for target image file '%s'\n", t->name);
+	return -1;
+}
+
+/*
+ * Create the target file with an image of t->size bytes at t->offset and
+ * provide its first map_size bytes for writing at t->ptr, either mapped or
+ * buffered. The remaining part is padding with t->pad bytes. For regular
+ * files zero padding is never touched and stays a sparse run of zeros (or is
+ * zeroed on flush if written in place), otherwise it is written on flush.
+ * MTD devices are buffered and written block by block on flush.
+ */
+static int uboot_env_prepare_target(struct file *t, size_t map_size)
+{
+	if (uboot_env_open_target(t))
+		return -1;
 
-	/* copy the source file, replacing \n by \0 */
-	end = s->ptr + s->size;
-	for (q = s->ptr; q < end; q++, p++)
-		*p = (*q == '\n') ? '\0' : *q;
+	if (t->regular && !t->update && uboot_env_extend_target(t) < 0) {
+		err("Can't resize target image file '%s': %s\n", t->name,
+				strerror(errno));
+		close(t->fd);
+		return -1;
+	}
 
-	/* trailer */
-	end = s->ptr + t->size;
-	for (q = s->ptr + s->size; q < end; q++)
-		*p = 0;
+	/*
+	 * Pipes and devices can't be mapped and faulting in a new mapping
+	 * costs more than a single write for small images, so buffer them.
+	 * Updated targets are compared against the buffer on flush.
+	 */
+	if (!t->regular || t->update || map_size < MMAP_MIN_SIZE) {
+		if (uboot_env_grow_target(t, map_size)) {
+			close(t->fd);
+			return -1;
+		}
+		t->map_size = map_size;
+		return 0;
+	}
 
-	/* now for the real CRC32 */
-	if (do_crc) {
-		uint32_t *crc = (uint32_t *) t->ptr;
-		*crc = crc32(0, t->ptr + CRC32_SIZE + flags_size, t->size - (CRC32_SIZE + flags_size));
+	t->ptr = uboot_env_mmap(t, map_size, PROT_READ|PROT_WRITE);
+	if (t->ptr == MAP_FAILED) {
+		err("Can't mmap target image file '%s': %s\n", t->name,
+				strerror(errno));
+		close(t->fd);
+		return -1;
 	}
+
+	return 0;
 }
 
-static int uboot_img_to_env(struct file *s, struct file *t)
+/* writev() the whole iovec array, restarting on short writes */
+static ssize_t writev_all(int fd, struct iovec *iov, int iovcnt)
 {
-	uint8_t *p, *q, *end;
-	uint32_t img_crc, crc;
-	size_t flags_size = 0;
-	bool found_data_end = false;
+	ssize_t ret, total = 0;
 
-	dbg("source file (bin):       %s\n", s->name);
-	dbg("source size:             %zd\n", s->size);
+	while (iovcnt > 0) {
+		ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += ret;
 
-	/* check CRC without flag */
-	img_crc = *((uint32_t *) s->ptr);
-	crc = crc32(0, s->ptr + CRC32_SIZE + flags_size, s->size - CRC32_SIZE - flags_size);
-	if (img_crc != crc) {
-		flags_size = 1;
-		crc = crc32(0, s->ptr + CRC32_SIZE + flags_size, s->size - CRC32_SIZE - flags_size);
-		if (img_crc != crc)
-			warn("source image with bad CRC.\n");
-	}
-
-	/* get the length of the data part */
-	end = s->ptr + s->size;
-	for (p = s->ptr + CRC32_SIZE + flags_size; (p < end - 1) && !found_data_end; p++) {
-		/* two null bytes mark the end of the data section */
-		if (*p == '\0' && *(p + 1) == '\0')
-			found_data_end = true;
+		for (; iovcnt > 0 && (size_t) ret >= iov->iov_len; iov++, iovcnt--)
+			ret -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
 	}
 
-	if (!found_data_end)
-		warn("No end of list delimiter found in source file\n");
+	return total;
+}
 
-	t->size = p - (s->ptr + CRC32_SIZE + flags_size);
-	/* don't copy the ending 2 NULL bytes */
-	if (found_data_end)
-		t->size--;
-	if (uboot_env_prepare_target(t))
-		return -1;
+/* write len bytes from buf followed by pad bytes of value fill (0x00 or 0xff) */
+static int write_padded(int fd, const uint8_t *buf, size_t len, size_t pad,
+			uint8_t fill)
+{
+	struct iovec iov[64];	/* well below IOV_MAX */
+	int n = 0;
 
-	dbg("target image file (env): %s\n", t->name);
-	dbg("target size:             %zd\n", t->size);
+	if (len > 0) {
+		iov[0].iov_base = (void *) buf;
+		iov[0].iov_len = len;
+		n = 1;
+	}
 
-	p = t->ptr;
-	end = s->ptr + CRC32_SIZE + flags_size + t->size;
-	for (q = s->ptr + CRC32_SIZE + flags_size; q < end; p++, q++)
-		*p = (*q == '\0') ? '\n' : *q;
+	do {
+		for (; n < (int) (sizeof(iov) / sizeof(iov[0])) && pad > 0; n++) {
+			iov[n].iov_base = (void *) (fill ? ff_buf : zero_buf);
+			iov[n].iov_len = pad < sizeof(zero_buf) ? pad : sizeof(zero_buf);
+			pad -= iov[n].iov_len;
+		}
+
+		if (writev_all(fd, iov, n) < 0)
+			return -1;
+		n = 0;
+	} while (pad > 0);
 
 	return 0;
 }
 
-static void usage_and_exit(int status)
+/* copy bytes [lo, hi) of the buffered image to dst, padding included */
+static void uboot_env_image_range(const struct file *t, uint8_t *dst,
+				  size_t lo, size_t hi)
 {
-	printf("usage: mkubootenv [-s <size>] [-f <flag>] [-n] <source file> <target file>\n"
-	       "  -s <size>  set size of the target image file to <size> bytes. If <size> is\n"
-	       "             bigger than the source file, the target image gets padded with null\n"
-	       "             bytes. If <size> is smaller than the source file, an error is emitted.\n"
-	       "  -f <flag>  set this flag if you are using redundant environments. Set <flag> to 1\n"
-	       "             for active environment or <flag> 0 for obsolete environment. If using\n"
-	       "             reverse operation, the value given with option -f is ignored.\n"
-	       "  -r         reverse operation: get plaintext env file (target) from binary image\n"
-	       "             file (source)\n"
-	       "  -n         do not calculate CRC32. CRC32 is filled with zeros. For reverse \n"
-	       "             operation, this option is ignored\n");
-	exit(status);
+	size_t mid = t->map_size;
+
+	mid = mid < lo ? lo : mid > hi ? hi : mid;
+	memcpy(dst, t->ptr + lo, mid - lo);
+	memset(dst + (mid - lo), t->pad, hi - mid);
 }
 
-int main(int argc, char **argv)
+/* true if all len bytes at p have value c */
+static bool mem_is(const uint8_t *p, uint8_t c, size_t len)
 {
-	int i;
-	int status = EXIT_FAILURE;
-	unsigned long flags = 0;
-	size_t img_size = 0;
-	size_t flags_size = 0;
-	bool reverse = false;
-	bool do_crc = true;
-	struct file s, t;	/* source and target file */
+	return len == 0 || (p[0] == c && memcmp(p, p + 1, len - 1) == 0);
+}
 
-	if (argc < 2)
-		usage_and_exit(EXIT_FAILURE);
+/*
+ * Write the buffered image followed by its padding to an MTD device. Only the erase blocks
+ * covered by the image are touched, data of partially covered blocks is
+ * preserved. Blocks which already contain the image are skipped. A block is
+ * only erased if one of its pages can't be programmed as is, i.e. it isn't
+ * erased (all 0xff) and, on NOR flash, bits would have to be set. After
+ * erasing, trailing pages of 0xff aren't written.
+ */
+static int uboot_env_flush_mtd(struct file *t)
+{
+	const struct mtd_info_user *mi = &t->mtd_info;
+	size_t es = mi->erasesize, ws = mi->writesize > 0 ? mi->writesize : 1;
+	off_t start = t->offset, end = t->offset + t->size, blk, lo, hi;
+	uint8_t *old, *new;
+	size_t i, pg, run, npages, last;
+	size_t nerased = 0, nwritten = 0, nskipped = 0;
+	bool erase, nor = mi->type == MTD_NORFLASH;
+	struct erase_info_user ei;
+	int ret = -1;
 
-	/* parse commandline options */
-	for (i = 1; (i + 1 < argc) && (argv[i][0] == '-'); i++) {
-		switch (argv[i][1]) {
-		case 's': {
-			char *opt = argv[++i];
-
-			if (strlen(opt) > 2 && opt[0] == '0' &&
-					(opt[1] == 'x' || opt[1] == 'X')) {
-				img_size = strtol(opt, NULL, 16);
-			} else {
-				img_size = strtoul(opt, NULL, 10);
+	if (end > (off_t) mi->size) {
+		err("Image doesn't fit into MTD device '%s' (%u bytes)\n",
+				t->name, mi->size);
+		return -1;
+	}
+
+	old = malloc(2 * es);
+	if (!old) {
+		err("Can't allocate erase block buffer\n");
+		return -1;
+	}
+	new = old + es;
+	npages = es / ws;
+
+	for (blk = start - start % es; blk < end; blk += es) {
+		if (mi->type == MTD_NANDFLASH || mi->type == MTD_MLCNANDFLASH) {
+			loff_t ofs = blk;
+
+			if (ioctl(t->fd, MEMGETBADBLOCK, &ofs) > 0) {
+				err("Bad erase block at 0x%llx in MTD device '%s'\n",
+						(unsigned long long) blk, t->name);
+				goto out;
 			}
+		}
 
-			if (img_size == 0) {
-				err("Invalid target image size: %zu. Must be greater than 0.\n", img_size);
-				exit(EXIT_FAILURE);
+		/*
+		 * An unreadable block is always erased, the part of it not
+		 * covered by the image is left erased.
+		 */
+		erase = pread(t->fd, old, es, blk) != (ssize_t) es;
+		if (erase)
+			memset(old, 0xff, es);
+
+		lo = start > blk ? start : blk;
+		hi = end < (off_t) (blk + es) ? end : (off_t) (blk + es);
+		memcpy(new, old, es);
+		uboot_env_image_range(t, new + (lo - blk), lo - start, hi - start);
+
+		if (!erase && memcmp(old, new, es) == 0) {
+			nskipped++;
+			continue;
+		}
+
+		for (pg = 0; pg < es && !erase; pg += ws) {
+			if (memcmp(old + pg, new + pg, ws) == 0 || mem_is(old + pg, 0xff, ws))
+				continue;
+			for (i = pg; nor && i < pg + ws && (old[i] & new[i]) == new[i]; i++)
+				;
+			erase = !nor || i < pg + ws;
+		}
+
+		if (erase) {
+			ei.start = blk;
+			ei.length = es;
+			if (ioctl(t->fd, MEMERASE, &ei) < 0) {
+				err("Can't erase block at 0x%llx in MTD device '%s': %s\n",
+						(unsigned long long) blk, t->name,
+						strerror(errno));
+				goto out;
 			}
-			break;
+			memset(old, 0xff, es);
+			nerased++;
 		}
-		case 'f': {
-			char *opt = argv[++i];
-			flags_size = FLAGS_SIZE;
-			flags = strtoul(opt, NULL, 10);
-			if (flags != 0 && flags != 1) {
-				err("Wrong value for option -f. Should be 0 or 1.\n");
-				usage_and_exit(EXIT_FAILURE);
+
+		/* trailing erased pages need no programming */
+		for (last = npages; last > 0 && mem_is(new + (last - 1) * ws, 0xff, ws); last--)
+			;
+		/* write runs of changed pages at once */
+		for (pg = 0, run = 0; pg <= last * ws; pg += ws) {
+			if (pg < last * ws && memcmp(old + pg, new + pg, ws) != 0)
+				continue;
+			if (pg > run && pwrite(t->fd, new + run, pg - run, blk + run) !=
+					(ssize_t) (pg - run)) {
+				err("Can't write to MTD device '%s': %s\n", t->name,
+						strerror(errno));
+				goto out;
 			}
-			break;
+			run = pg + ws;
 		}
-		case 'r':
-			reverse = true;
-			break;
-		case 'n':
-			do_crc = false;
-			break;
-		case 'h':
-			status = EXIT_SUCCESS;
-			/* fall through */
-		default:
-			usage_and_exit(status);
-			break;
+		nwritten++;
+	}
+
+	if (t->update)
+		info("%s: %zu erase blocks rewritten (%zu erased), %zu unchanged\n",
+		     t->name, nwritten, nerased, nskipped);
+	ret = 0;
+out:
+	free(old);
+	return ret;
+}
+
+/*
+ * Write the buffered image to the target, comparing it block by block with
+ * the existing content and only rewriting the blocks which differ. Blocks are
+ * aligned to the preferred I/O size of the target. Unless written in place,
+ * a regular target is truncated to the image size afterwards.
+ */
+static int uboot_env_flush_update(struct file *t)
+{
+	struct stat sbuf;
+	size_t bs, off, len, nwritten = 0, nskipped = 0;
+	uint8_t *old = NULL, *new;
+	int ret = -1;
+
+	if (fstat(t->fd, &sbuf) < 0)
+		goto write_err;
+	bs = sbuf.st_blksize >= 512 && sbuf.st_blksize <= 1024 * 1024 ?
+	     (size_t) sbuf.st_blksize : 4096;
+
+	old = malloc(2 * bs);
+	if (!old) {
+		err("Can't allocate update buffer\n");
+		return -1;
+	}
+	new = old + bs;
+
+	for (off = 0; off < t->size; off += len) {
+		len = bs - (t->offset + off) % bs;
+		if (len > t->size - off)
+			len = t->size - off;
+
+		uboot_env_image_range(t, new, off, off + len);
+		if (pread(t->fd, old, len, t->offset + off) == (ssize_t) len &&
+		    memcmp(old, new, len) == 0) {
+			nskipped += len;
+			continue;
 		}
+
+		if (pwrite(t->fd, new, len, t->offset + off) != (ssize_t) len)
+			goto write_err;
+		nwritten += len;
 	}
 
-	/* we expect two filenames */
-	if (i + 2 > argc)
-		usage_and_exit(EXIT_FAILURE);
+	if (t->regular && !t->keep && sbuf.st_size != (off_t) t->size &&
+	    ftruncate(t->fd, t->size) < 0)
+		goto write_err;
 
-	if (reverse && img_size > 0)
-		warn("Image size specified in reverse mode will be ignored\n");
+	info("%s: %zu bytes rewritten, %zu bytes unchanged\n", t->name,
+	     nwritten, nskipped);
+	ret = 0;
+	goto out;
 
-	if (reverse && !do_crc)
-		warn("Disabling of CRC generation will be ignored in reverse mode\n");
+write_err:
+	err("Can't write to target image file '%s': %s\n", t->name,
+			strerror(errno));
+out:
+	free(old);
+	return ret;
+}
 
-	if (reverse && flags_size)
-		warn("Flags option will be ignored in reverse mode\n");
+/*
+ * Write out a buffered target, followed by the padding unless the target is a
+ * regular file which has been truncated to the right size already.
+ */
+static int uboot_env_flush_target(struct file *t)
+{
+	size_t pad = t->size - t->map_size;
 
-	uboot_env_init_file(&s);
-	uboot_env_init_file(&t);
-	s.name = argv[i];
-	t.name = argv[i+1];
+	if (t->mtd)
+		return uboot_env_flush_mtd(t);
+	if (t->update)
+		return uboot_env_flush_update(t);
 
-	if (uboot_env_prepare_source(&s))
-		exit(EXIT_FAILURE);
+	if (t->buffered &&
+	    write_padded(t->fd, t->ptr, t->map_size, t->regular ? 0 : pad, t->pad) < 0)
+		goto write_err;
 
-	if (!reverse) {
-		size_t min_img_size = CRC32_SIZE + flags_size + s.size + TRAILER_SIZE;
+	if (t->regular && uboot_env_pad_target(t, t->offset + t->map_size, pad) < 0)
+		goto write_err;
 
-		/* TODO: Check source file format:
-		 *	var=value\n
-		 */
+	return 0;
 
-		/*
-		 * check whether the size hasn't been set or whether the source file +
-		 * CRC + trailer fits into the specified size.
-		 */
-		if (img_size == 0)
-			img_size = min_img_size;
-		else if (img_size < min_img_size) {
-			err("Specified size (%zu) is too small for the source"
-			    "file to fit into. Must be at least %zu bytes.\n",
-			    img_size, min_img_size);
-			goto cleanup_source;
-		}
+write_err:
+	err("Can't write to target image file '%s': %s\n", t->name,
+			strerror(errno));
+	return -1;
+}
 
-		t.size = img_size;
-		if (uboot_env_prepare_target(&t))
-			goto cleanup_source;
+/*
+ * Remove a regular target written from scratch by a failed conversion, so no
+ * partial image or text is left behind. Targets written in place can't be
+ * restored and are left as they are.
+ */
+static void uboot_env_discard_target(struct file *t)
+{
+	if (t->regular && !t->keep && !t->update)
+		unlink(t->name);
+}
 
-		uboot_env_to_img(&s, &t, flags, flags_size, do_crc);
-	} else {
-		if (uboot_img_to_env(&s, &t))
-			goto cleanup_source;
+/* sync the target to its device, if it supports it (e.g. not a pipe) */
+static int uboot_env_sync_target(struct file *t)
+{
+	if (fsync(t->fd) == 0 || errno == EINVAL)
+		return 0;
+
+	err("Can't sync target image file '%s': %s\n", t->name,
+			strerror(errno));
+	return -1;
+}
+
+static void uboot_env_cleanup_file(struct file *f)
+{
+	if (f->buffered) {
+		if (!f->buf)
+			free(f->ptr);
 	}
+	else if (f->ptr != MAP_FAILED)
+		munmap(f->ptr - f->map_delta, f->map_delta + f->map_size);
+	if (f->fd > STDERR_FILENO)
+		close(f->fd);
+}
 
-	status = EXIT_SUCCESS;
+static void env_check_issue(void *arg, enum env_issue issue, size_t lineno,
+			    size_t col)
+{
+	struct env_check *chk = arg;
+	const char *msg = "";
 
-	uboot_env_cleanup_file(&t);
-cleanup_source:
-	uboot_env_cleanup_file(&s);
+	switch (issue) {
+	case ENV_ISSUE_BLANK_LINE:
+		msg = "empty line removed";
+		break;
+	case ENV_ISSUE_CR:
+		msg = chk->strip_cr ? "carriage return removed" :
+		      "carriage return at end of line, use --strip-cr to remove it";
+		break;
+	case ENV_ISSUE_NO_EQUALS:
+		msg = "missing '=' after variable name";
+		break;
+	case ENV_ISSUE_EMPTY_NAME:
+		msg = "empty variable name";
+		break;
+	}
+	warn("%s:%zu:%zu: %s\n", chk->name, lineno, col, msg);
+	chk->nwarnings++;
+}
+
+static void env_check_line(void *arg, const uint8_t *name, size_t name_len,
+			   size_t lineno)
+{
+	struct env_check *chk = arg;
+	size_t nvars = chk->names.nvars;
+
+	/* out of memory only means that duplicates may go unnoticed */
+	if (env_index_set(&chk->names, name, name_len, name, 0) &&
+	    chk->names.nvars == nvars) {
+		warn("%s:%zu:1: duplicate definition of '%.*s'\n", chk->name,
+		     lineno, (int) name_len, name);
+		chk->nwarnings++;
+	}
+}
+
+static void env_check_init(struct env_check *chk, const struct file *s,
+			   const struct env_opts *o)
+{
+	chk->name = s->name;
+	chk->strip_cr = o->strip_cr;
+	env_index_init(&chk->names);
+	chk->nwarnings = 0;
+}
+
+/*
+ * Convert source s into the mapped image t, see env_encode(). The mapping
+ * may end before the trailer and padding if they are zero.
+ */
+static int uboot_env_to_img(struct file *s, struct file *t, uint8_t flags,
+			    size_t flags_size, const struct env_opts *o)
+{
+	struct env_check chk;
+	struct env_encode_opts eo = {
+		.flag = flags,
+		.pad = t->pad,
+		.size = t->size,
+		.issue = env_check_issue,
+		.line = o->duplicates ? env_check_line : NULL,
+		.arg = &chk,
+	};
+	unsigned int eflags = o->endian | ENV_PARALLEL;
+	ssize_t ret;
+
+	dbg("source file (env):       %s\n", s->name);
+	dbg("target image file (bin): %s\n", t->name);
+	dbg("target size:             %zd\n", t->size);
+
+	if (flags_size > 0)
+		eflags |= ENV_REDUNDANT;
+	if (!o->do_crc)
+		eflags |= ENV_NO_CRC;
+	if (o->strip_cr)
+		eflags |= ENV_STRIP_CR;
+
+	env_check_init(&chk, s, o);
+	ret = env_encode(s->ptr, s->size, t->ptr, t->map_size, eflags, &eo);
+	env_index_free(&chk.names);
+	s->nwarnings += chk.nwarnings;
+	if (ret < 0) {
+		err("Can't create image of source file '%s': %s\n", s->name,
+				strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* flags of env_check() for the binary images given by o */
+static inline unsigned int uboot_img_flags(const struct env_opts *o)
+{
+	return (o->redundant ? ENV_REDUNDANT : 0) |
+	       (o->reverse && o->no_flag ? ENV_NO_FLAGS : 0) |
+	       o->endian | ENV_PARALLEL;
+}
+
+/*
+ * Check the binary image file name without converting it and store the
+ * result in *ii. Returns 0 if it has a good CRC32 and a terminated data part,
+ * otherwise -1 with *error set if the image couldn't be checked at all.
+ */
+static int uboot_env_verify(const char *name, const struct env_opts *o,
+			    struct env_info *ii, const char **error,
+			    struct env_stats *st)
+{
+	struct file s;
+	int ret = -1;
+
+	memset(ii, 0, sizeof(*ii));
+	uboot_env_init_file(&s);
+	s.name = name;
+	s.offset = o->offset;
+	s.size = o->img_size;
+
+	stats_start(st);
+	if (uboot_env_prepare_source(&s)) {
+		*error = "can't open image";
+		return -1;
+	}
+	stats_phase(st, STAT_SOURCE);
+	if (!s.regular) {
+		err("Image file '%s' must be a regular file\n", name);
+		*error = "not a regular file";
+		goto out;
+	}
+	if (s.size < CRC32_SIZE + TRAILER_SIZE) {
+		err("Image file '%s' is too small\n", name);
+		*error = "image too small";
+		goto out;
+	}
+
+	env_check(s.ptr, s.size, uboot_img_flags(o), ii);
+	stats_phase(st, STAT_CHECK);
+	if (st) {
+		st->bytes_in = s.size;
+		st->source_backend = "mmap";
+	}
+	if (ii->crc_ok && ii->terminated)
+		ret = 0;
+out:
+	uboot_env_cleanup_file(&s);
+	return ret;
+}
+
+/*
+ * Print the variables named in the comma separated lists names of the binary
+ * image file name as "name=value" lines, in the order given. The records are
+ * indexed in place in the mapped image, so all lookups cost a single scan.
+ */
+static int uboot_env_get(const char *name, const char **names, size_t nnames,
+			 const struct env_opts *o)
+{
+	struct file s;
+	struct env_info ii;
+	struct env_index idx;
+	const struct env_var *v;
+	const char *p, *q;
+	size_t i;
+	int ret = -1;
+
+	uboot_env_init_file(&s);
+	env_index_init(&idx);
+	s.name = name;
+	s.offset = o->offset;
+	s.size = o->img_size;
+
+	if (uboot_env_prepare_source(&s))
+		return -1;
+	if (!s.regular) {
+		err("Image file '%s' must be a regular file\n", name);
+		goto out;
+	}
+	if (s.size < CRC32_SIZE + TRAILER_SIZE) {
+		err("Image file '%s' is too small\n", name);
+		goto out;
+	}
+
+	env_check(s.ptr, s.size, uboot_img_flags(o), &ii);
+	if (!ii.crc_ok)
+		warn("source image with bad CRC.\n");
+	if (env_index_parse(&idx, s.ptr + CRC32_SIZE + ii.flags_size, ii.data_len,
+			    '\0', false)) {
+		err("Can't allocate index for image file '%s'\n", name);
+		goto out;
+	}
+
+	ret = 0;
+	for (i = 0; i < nnames; i++) {
+		for (p = names[i]; *p; p = *q ? q + 1 : q) {
+			q = strchrnul(p, ',');
+			if (q == p)
+				continue;
+			v = env_index_find(&idx, (const uint8_t *) p, q - p);
+			if (!v) {
+				err("Variable '%.*s' not defined\n", (int) (q - p), p);
+				ret = -1;
+				continue;
+			}
+			fwrite(v->name, 1, v->name_len, stdout);
+			putchar('=');
+			fwrite(v->value, 1, v->value_len, stdout);
+			putchar('\n');
+		}
+	}
+out:
+	env_index_free(&idx);
+	uboot_env_cleanup_file(&s);
+	return ret;
+}
+
+/* print str as JSON string literal */
+static void json_print_string(FILE *fp, const char *str)
+{
+	const unsigned char *p;
+
+	fputc('"', fp);
+	for (p = (const unsigned char *) str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+/* print the result of uboot_env_verify() as one line of JSON */
+static void verify_print_json(FILE *fp, const char *name,
+			      const struct env_info *ii, const char *error)
+{
+	fputs("{\"file\":", fp);
+	json_print_string(fp, name);
+	if (error) {
+		fputs(",\"ok\":false,\"error\":", fp);
+		json_print_string(fp, error);
+		fputs("}\n", fp);
+		return;
+	}
+
+	fprintf(fp, ",\"ok\":%s,\"crc_ok\":%s,\"terminated\":%s,\"redundant\":%s",
+		ii->crc_ok && ii->terminated ? "true" : "false",
+		ii->crc_ok ? "true" : "false",
+		ii->terminated ? "true" : "false",
+		ii->flags_size ? "true" : "false");
+	if (ii->flags_size)
+		fprintf(fp, ",\"flags\":%u", ii->flags);
+	fprintf(fp, ",\"data_length\":%zu,\"free\":%zu}\n", ii->data_len,
+		ii->terminated ? ii->data_size - ii->data_len - TRAILER_SIZE : 0);
+}
+
+/* chunk of a dump scanned by a worker at a time, rounded up to the alignment */
+#define SCAN_CHUNK_SIZE		(1024 * 1024)
+/* sizes tried for images found by --scan without -s */
+#define SCAN_SIZE_STEP		512
+/* longest variable name accepted by the pre-filter of --scan */
+#define SCAN_NAME_MAX		64
+
+/* image found by --scan */
+struct scan_hit {
+	size_t offset;
+	size_t size;
+	size_t flags_size;
+	uint8_t flags;
+	size_t data_len;
+	bool ok;		/* the CRC32 matches */
+};
+
+/* hits of one chunk of a dump, see scan_worker() */
+struct scan_chunk {
+	struct scan_hit *hits;
+	size_t nhits;
+	int status;
+};
+
+/* state of --scan shared by the workers */
+struct scan {
+	const struct file *f;
+	const struct env_opts *o;
+	size_t chunk_size;
+	struct scan_chunk *chunks;
+	size_t nchunks;
+	size_t next;		/* next chunk to be scanned */
+};
+
+/* pre-filter of --scan: p starts with a plausible "name=" */
+static bool scan_name(const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	if (len > SCAN_NAME_MAX + 1)
+		len = SCAN_NAME_MAX + 1;
+	for (i = 0; i < len; i++) {
+		if (p[i] == '=')
+			return i > 0;
+		if (p[i] <= ' ' || p[i] >= 0x7f)
+			return false;
+	}
+
+	return false;
+}
+
+/* every string of the data is a plausible "name=value" with a text value */
+static bool scan_well_formed(const uint8_t *data, size_t len)
+{
+	const uint8_t *end = data + len;
+
+	while (data < end) {
+		if (!scan_name(data, end - data))
+			return false;
+		for (; data < end && *data; data++) {
+			if ((*data < ' ' && *data != '\t' && *data != '\n' &&
+			     *data != '\r') || *data >= 0x7f)
+				return false;
+		}
+		data++;
+	}
+
+	return true;
+}
+
+/*
+ * Check for an image at p, len bytes before the end of the dump. Candidates
+ * pass the pre-filter on the first variable name and need the two null bytes
+ * at the end of the data. Unless the size is given, the CRC32 is tried at the
+ * end of the data and at each multiple of SCAN_SIZE_STEP within the padding
+ * after it, extending it in closed form. Candidates with a bad CRC32 are
+ * only reported if all of their data looks like variables.
+ */
+static bool scan_image(const uint8_t *p, size_t len, const struct env_opts *o,
+		       struct scan_hit *h)
+{
+	/* the scan workers keep all CPUs busy already */
+	unsigned int flags = uboot_img_flags(o) & ~ENV_PARALLEL;
+	size_t hdr_size, size, end;
+	const uint8_t *data;
+	struct env_info ii;
+	uint32_t crc, img_crc;
+	uint8_t pad;
+
+	if (len < CRC32_SIZE + FLAGS_SIZE + TRAILER_SIZE)
+		return false;
+	h->flags_size = o->redundant || env_looks_like_flags(p[CRC32_SIZE]) ?
+			FLAGS_SIZE : 0;
+	h->flags = p[CRC32_SIZE];
+	hdr_size = CRC32_SIZE + h->flags_size;
+	data = p + hdr_size;
+	if (!scan_name(data, len - hdr_size))
+		return false;
+
+	if (o->img_size > 0) {
+		if (len < o->img_size ||
+		    env_check(p, o->img_size,
+			      flags | (h->flags_size ? ENV_REDUNDANT : 0), &ii) ||
+		    !ii.terminated)
+			return false;
+		h->size = o->img_size;
+		h->flags_size = ii.flags_size;
+		h->data_len = ii.data_len;
+		h->ok = ii.crc_ok;
+		data = p + CRC32_SIZE + ii.flags_size;
+	} else {
+		h->data_len = find_double_nul(data, len - hdr_size);
+		if (h->data_len == len - hdr_size)
+			return false;
+
+		img_crc = env_load_crc(p, flags);
+		crc = crc32_zeros(crc32_update(0, data, h->data_len),
+				  TRAILER_SIZE);
+		size = hdr_size + h->data_len + TRAILER_SIZE;
+		/* the newline at the end of a source leaves a third null byte */
+		if (crc != img_crc && size < len && p[size] == 0) {
+			crc = crc32_zeros(crc, 1);
+			size++;
+		}
+		pad = size < len ? p[size] : 0;
+		while (crc != img_crc && (pad == 0x00 || pad == 0xff)) {
+			end = (size / SCAN_SIZE_STEP + 1) * SCAN_SIZE_STEP;
+			if (end > len || !mem_is(p + size, pad, end - size))
+				break;
+			crc = crc32_fill(crc, pad, end - size);
+			size = end;
+		}
+		h->ok = crc == img_crc;
+		h->size = h->ok ? size : hdr_size + h->data_len + TRAILER_SIZE;
+	}
+
+	return h->ok || scan_well_formed(data, h->data_len);
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan *sc = arg;
+	const struct file *f = sc->f;
+	size_t align = sc->o->align, i, off, end;
+	struct scan_chunk *c;
+	struct scan_hit h, *hits;
+
+	while ((i = __atomic_fetch_add(&sc->next, 1, __ATOMIC_RELAXED)) < sc->nchunks) {
+		c = &sc->chunks[i];
+		off = i * sc->chunk_size;
+		end = off + sc->chunk_size < f->size ? off + sc->chunk_size : f->size;
+		while (off < end) {
+			if (!scan_image(f->ptr + off, f->size - off, sc->o, &h)) {
+				off += align;
+				continue;
+			}
+
+			hits = realloc(c->hits, (c->nhits + 1) * sizeof(*hits));
+			if (!hits) {
+				c->status = -1;
+				break;
+			}
+			h.offset = off;
+			hits[c->nhits++] = h;
+			c->hits = hits;
+			/* images don't overlap, nothing to find in a valid one */
+			off += h.ok ? (h.size + align - 1) / align * align : align;
+		}
+	}
+
+	return NULL;
+}
+
+/* print an image found by uboot_env_scan() as one line of JSON */
+static void scan_print_json(FILE *fp, const char *name,
+			    const struct scan_hit *h)
+{
+	fputs("{\"file\":", fp);
+	json_print_string(fp, name);
+	fprintf(fp, ",\"offset\":%zu,\"size\":%zu,\"ok\":%s,\"redundant\":%s",
+		h->offset, h->size, h->ok ? "true" : "false",
+		h->flags_size ? "true" : "false");
+	if (h->flags_size)
+		fprintf(fp, ",\"flags\":%u", h->flags);
+	fprintf(fp, ",\"data_length\":%zu}\n", h->data_len);
+}
+
+/*
+ * Find the images in a flash dump at multiples of o->align, one worker
+ * thread per CPU scanning a chunk of the mapped dump at a time. The images
+ * found are printed as JSON in the order of their offsets, leaving out
+ * those inside one found before unless they are valid and it isn't. Returns
+ * 0 if at least one valid image has been found.
+ */
+static int uboot_env_scan(const char *name, const struct env_opts *o)
+{
+	pthread_t *threads = NULL;
+	size_t nthreads, started, i, j, covered = 0, found = 0;
+	bool covered_ok = false;
+	struct scan sc;
+	struct file s;
+	struct scan_hit *h;
+	long ncpus;
+	int ret = -1;
+
+	memset(&sc, 0, sizeof(sc));
+	if (o->img_size > 0 && o->img_size < CRC32_SIZE + FLAGS_SIZE + TRAILER_SIZE) {
+		err("Specified size (%zu) is too small for an image\n", o->img_size);
+		return -1;
+	}
+
+	uboot_env_init_file(&s);
+	s.name = name;
+	if (uboot_env_prepare_source(&s))
+		return -1;
+	if (!s.regular) {
+		err("Dump file '%s' must be a regular file\n", name);
+		goto out;
+	}
+
+	sc.f = &s;
+	sc.o = o;
+	sc.chunk_size = (SCAN_CHUNK_SIZE + o->align - 1) / o->align * o->align;
+	sc.nchunks = (s.size + sc.chunk_size - 1) / sc.chunk_size;
+	sc.chunks = calloc(sc.nchunks ? sc.nchunks : 1, sizeof(*sc.chunks));
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpus > 1 ? (size_t) ncpus : 1;
+	if (nthreads > sc.nchunks)
+		nthreads = sc.nchunks ? sc.nchunks : 1;
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!sc.chunks || !threads) {
+		err("Can't allocate scan workers\n");
+		goto out;
+	}
+
+	/* the calling thread is one of the workers */
+	for (started = 1; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, scan_worker, &sc) != 0)
+			break;
+	}
+	scan_worker(&sc);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < sc.nchunks; i++) {
+		if (sc.chunks[i].status) {
+			err("Can't allocate scan results\n");
+			goto out;
+		}
+		for (j = 0; j < sc.chunks[i].nhits; j++) {
+			h = &sc.chunks[i].hits[j];
+			/* a valid image may follow the data of a bad one */
+			if (h->offset < covered && (covered_ok || !h->ok))
+				continue;
+			scan_print_json(stdout, name, h);
+			covered = h->offset + h->size;
+			covered_ok = h->ok;
+			if (h->ok)
+				found++;
+		}
+	}
+	if (found)
+		ret = 0;
+	else
+		err("No valid environment found in dump file '%s'\n", name);
+
+out:
+	for (i = 0; i < sc.nchunks && sc.chunks; i++)
+		free(sc.chunks[i].hits);
+	free(sc.chunks);
+	free(threads);
+	uboot_env_cleanup_file(&s);
+	return ret;
+}
+
+static void json_print_string_or_null(FILE *fp, const char *str)
+{
+	if (str)
+		json_print_string(fp, str);
+	else
+		fputs("null", fp);
+}
+
+/* print the stats of one conversion of source to target (if any) to stderr */
+static void stats_print(unsigned int mode, const char *source,
+			const char *target, bool ok, const struct env_stats *st)
+{
+	const char *name = target ? target : source;
+	unsigned int i;
+
+	if (mode == STATS_JSON) {
+		fputs("{\"source\":", stderr);
+		json_print_string(stderr, source);
+		fputs(",\"target\":", stderr);
+		json_print_string_or_null(stderr, target);
+		fprintf(stderr, ",\"ok\":%s,\"source_backend\":", ok ? "true" : "false");
+		json_print_string_or_null(stderr, st->source_backend);
+		fputs(",\"target_backend\":", stderr);
+		json_print_string_or_null(stderr, st->target_backend);
+		fprintf(stderr, ",\"convert_kernel\":\"%s\",\"crc32_kernel\":\"%s\"",
+			convert_kernel(), crc32_kernel());
+		fprintf(stderr, ",\"bytes_in\":%zu,\"bytes_out\":%zu,\"ns\":{",
+			st->bytes_in, st->bytes_out);
+		for (i = 0; i < NR_STAT_PHASES; i++)
+			fprintf(stderr, "\"%s\":%" PRIu64 ",", stat_phase_names[i],
+				st->ns[i]);
+		fprintf(stderr, "\"total\":%" PRIu64 "},\"minflt\":{", stats_total_ns(st));
+		for (i = 0; i < NR_STAT_PHASES; i++)
+			fprintf(stderr, "%s\"%s\":%ld", i ? "," : "",
+				stat_phase_names[i], st->minflt[i]);
+		fputs("},\"majflt\":{", stderr);
+		for (i = 0; i < NR_STAT_PHASES; i++)
+			fprintf(stderr, "%s\"%s\":%ld", i ? "," : "",
+				stat_phase_names[i], st->majflt[i]);
+		fputs("}}\n", stderr);
+		return;
+	}
+
+	info("%s: %zu bytes in (%s), %zu bytes out (%s), kernels %s/%s%s\n",
+	     name, st->bytes_in, st->source_backend ? st->source_backend : "-",
+	     st->bytes_out, st->target_backend ? st->target_backend : "-",
+	     convert_kernel(), crc32_kernel(), ok ? "" : ", failed");
+	info("%s:", name);
+	for (i = 0; i < NR_STAT_PHASES; i++)
+		fprintf(stderr, " %s %.1f us,", stat_phase_names[i],
+			st->ns[i] / 1000.0);
+	fprintf(stderr, " total %.1f us\n", stats_total_ns(st) / 1000.0);
+	info("%s: page faults (minor/major):", name);
+	for (i = 0; i < NR_STAT_PHASES; i++)
+		fprintf(stderr, " %s %ld/%ld%s", stat_phase_names[i],
+			st->minflt[i], st->majflt[i],
+			i < NR_STAT_PHASES - 1 ? "," : "\n");
+}
+
+static int uboot_img_to_env(struct file *s, struct file *t, unsigned int flags,
+			    struct env_stats *st)
+{
+	struct env_info ii;
+
+	dbg("source file (bin):       %s\n", s->name);
+	dbg("source size:             %zd\n", s->size);
+
+	if (env_check(s->ptr, s->size, flags, &ii)) {
+		err("Source image file '%s' is too small\n", s->name);
+		return -1;
+	}
+	if (!ii.crc_ok)
+		warn("source image with bad CRC.\n");
+	if (!ii.terminated)
+		warn("No end of list delimiter found in source file\n");
+	s->nwarnings += !ii.crc_ok + !ii.terminated;
+	t->size = ii.data_len;
+	stats_phase(st, STAT_CHECK);
+
+	if (uboot_env_prepare_target(t, t->size))
+		return -1;
+	stats_phase(st, STAT_TARGET);
+
+	dbg("target image file (env): %s\n", t->name);
+	dbg("target size:             %zd\n", t->size);
+
+	convert(t->ptr, s->ptr + CRC32_SIZE + ii.flags_size, t->size, '\0', '\n');
+	stats_phase(st, STAT_CONVERT);
+
+	return 0;
+}
+
+/*
+ * Copy the data of the mapped binary image s into image t of the size given
+ * by o (or the size of s), see env_resize(). The flags byte is detected as
+ * for uboot_img_to_env(), then set or removed according to o.
+ */
+static int uboot_img_resize(struct file *s, struct file *t,
+			    const struct env_opts *o, struct env_stats *st)
+{
+	struct env_info ii;
+	struct env_encode_opts eo = {
+		.flag = o->flags,
+		.pad = t->pad,
+	};
+	unsigned int flags = o->endian;
+	size_t min_img_size;
+
+	if (env_check(s->ptr, s->size, uboot_img_flags(o), &ii)) {
+		err("Source image file '%s' is too small\n", s->name);
+		return -1;
+	}
+	if (!ii.crc_ok)
+		warn("source image with bad CRC.\n");
+	if (!ii.terminated)
+		warn("No end of list delimiter found in source file\n");
+	s->nwarnings += !ii.crc_ok + !ii.terminated;
+	stats_phase(st, STAT_CHECK);
+
+	if (o->flags_size)
+		flags |= ENV_SET_FLAG;
+	else if (o->no_flag)
+		flags |= ENV_DROP_FLAG;
+	if (!o->do_crc)
+		flags |= ENV_NO_CRC;
+
+	min_img_size = CRC32_SIZE + env_resized_flags_size(&ii, flags) +
+		       ii.data_len + TRAILER_SIZE;
+	t->size = o->img_size > 0 ? o->img_size : s->size;
+	if (t->size < min_img_size) {
+		err("Specified size (%zu) is too small for the source image "
+		    "data to fit into. Must be at least %zu bytes.\n", t->size,
+		    min_img_size);
+		return -1;
+	}
+
+	/* the trailer is written along with non-zero padding */
+	if (uboot_env_prepare_target(t, min_img_size - (t->pad ? 0 : TRAILER_SIZE)))
+		return -1;
+	stats_phase(st, STAT_TARGET);
+
+	eo.size = t->size;
+	if (env_resize(s->ptr, &ii, t->ptr, t->map_size, flags, &eo) < 0) {
+		err("Can't resize source image file '%s': %s\n", s->name,
+				strerror(errno));
+		return -1;
+	}
+	stats_phase(st, STAT_CONVERT);
+
+	return 0;
+}
+
+/* read up to len bytes, only returning less on end of file */
+static ssize_t read_full(int fd, uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+	size_t total = 0;
+
+	while (total < len) {
+		ret = read(fd, buf + total, len - total);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+
+	return total;
+}
+
+/*
+ * Set up the decompression of a compressed source, detected by its magic. A
+ * mapped source is decompressed straight from the mapping. Otherwise the
+ * first bytes are read into buf to check for the magic and, if the source
+ * isn't compressed after all, left there with their number in *have.
+ */
+static int uboot_env_open_decomp(struct file *s, struct decomp **d,
+				 uint8_t *buf, size_t *have)
+{
+	ssize_t n;
+
+	if (!s->regular) {
+		n = read_full(s->fd, buf, DECOMP_MAGIC_SIZE);
+		if (n < 0) {
+			err("Can't read from source file '%s': %s\n", s->name,
+					strerror(errno));
+			return -1;
+		}
+		*have = n;
+		s->compressed = decomp_detect(buf, n);
+	}
+	if (!s->compressed)
+		return 0;
+
+	if (s->regular)
+		*d = decomp_open(s->compressed, -1, s->ptr, s->size);
+	else
+		*d = decomp_open(s->compressed, s->fd, buf, *have);
+	if (!*d) {
+		if (errno == ENOTSUP)
+			err("Source file '%s' is %s compressed, which isn't "
+			    "supported by this build\n", s->name,
+			    decomp_name(s->compressed));
+		else
+			err("Can't set up decompression of source file '%s': %s\n",
+			    s->name, strerror(errno));
+		return -1;
+	}
+	*have = 0;
+
+	return 0;
+}
+
+/*
+ * Streaming variant of uboot_env_to_img() for sources which can't be mapped.
+ * The source is read, converted and written in chunks. The CRC32 in front of
+ * the image is written last by seeking back, so memory use is bounded. If the
+ * target isn't seekable, the payload needs to be buffered up to the end.
+ * Only whole lines are converted at a time, the rest is kept for the next
+ * chunk, unless a line is longer than a chunk. Such lines are only checked
+ * in part. Compressed sources, mapped or not, are decompressed into the
+ * chunks, see uboot_env_open_decomp().
+ */
+static int uboot_env_stream_to_img(struct file *s, struct file *t,
+				   const struct env_opts *o)
+{
+	uint8_t hdr[CRC32_SIZE + FLAGS_SIZE] = { 0 };
+	size_t img_size = o->img_size, hdr_size = CRC32_SIZE + o->flags_size;
+	size_t payload_size = 0, src_size = 0, have = 0, used, len, pad;
+	uint8_t *in, *out = NULL, *dst, *nl;
+	struct decomp *d = NULL;
+	struct env_check chk;
+	struct env_conv c;
+	uint32_t crc = 0;
+	off_t start;
+	ssize_t n;
+	int ret = -1;
+
+	if (uboot_env_open_target(t))
+		return -1;
+
+	in = malloc(STREAM_CHUNK_SIZE);
+	if (!in) {
+		err("Can't allocate stream buffer\n");
+		return -1;
+	}
+	if (uboot_env_open_decomp(s, &d, in, &have))
+		goto out;
+
+	/* the names of a chunk are gone after it, so no duplicates are found */
+	env_check_init(&chk, s, o);
+	memset(&c, 0, sizeof(c));
+	c.strip_cr = o->strip_cr;
+	c.issue = env_check_issue;
+	c.arg = &chk;
+	hdr[CRC32_SIZE] = o->flags;
+	/* MTD devices and updated targets are written as a whole on flush */
+	start = t->mtd || t->update ? -1 : lseek(t->fd, 0, SEEK_CUR);
+	if (start >= 0) {
+		out = malloc(STREAM_CHUNK_SIZE);
+		if (!out) {
+			err("Can't allocate stream buffer\n");
+			goto out;
+		}
+		/* CRC32 placeholder, will be filled later */
+		if (write_padded(t->fd, hdr, hdr_size, 0, 0) < 0)
+			goto write_err;
+	}
+
+	do {
+		if (d)
+			n = decomp_read(d, in + have, STREAM_CHUNK_SIZE - have);
+		else
+			n = read_full(s->fd, in + have, STREAM_CHUNK_SIZE - have);
+		if (n < 0) {
+			err("Can't %s source file '%s': %s\n",
+			    d ? "decompress" : "read from", s->name, strerror(errno));
+			goto out;
+		}
+		have += n;
+
+		/* everything that is left goes at the end of the source */
+		nl = n > 0 ? memrchr(in, '\n', have) : NULL;
+		used = nl ? (size_t) (nl + 1 - in) : have;
+		if (used == 0 || (!nl && n > 0 && have < STREAM_CHUNK_SIZE))
+			continue;
+
+		/* the size is checked without the bytes removed by the checks */
+		src_size += used;
+		if (img_size > 0 && hdr_size + src_size + TRAILER_SIZE > img_size) {
+			err("Specified size (%zu) is too small for the source "
+			    "file to fit into.\n", img_size);
+			goto out;
+		}
+
+		if (start >= 0) {
+			dst = out;
+		} else {
+			if (uboot_env_grow_target(t, hdr_size + payload_size + used))
+				goto out;
+			dst = t->ptr + hdr_size + payload_size;
+		}
+
+		c.more = n > 0;
+		len = convert_env(dst, in, used, &c, o->do_crc ? &crc : NULL);
+
+		if (start >= 0 && write_padded(t->fd, out, len, 0, 0) < 0)
+			goto write_err;
+		payload_size += len;
+		have -= used;
+		memmove(in, in + used, have);
+	} while (n > 0);
+
+	/* the size of what was read, for --stats */
+	s->size = src_size;
+	s->nwarnings += chk.nwarnings;
+	t->size = img_size > 0 ? img_size : hdr_size + src_size + TRAILER_SIZE;
+	pad = t->size - hdr_size - payload_size - TRAILER_SIZE;
+	if (o->do_crc) {
+		crc = crc32_zeros(crc, TRAILER_SIZE);
+		crc = crc32_fill(crc, t->pad, pad);
+		env_store_crc(hdr, crc, o->endian);
+	}
+
+	if (start < 0) {
+		/* neither seekable nor mapped, the whole image goes out at once */
+		if (uboot_env_grow_target(t, hdr_size + payload_size + TRAILER_SIZE))
+			goto out;
+		memcpy(t->ptr, hdr, hdr_size);
+		memset(t->ptr + hdr_size + payload_size, 0, TRAILER_SIZE);
+		t->map_size = hdr_size + payload_size + TRAILER_SIZE;
+		ret = uboot_env_flush_target(t);
+		goto out;
+	}
+
+	/* trailer and padding, sparse for regular files */
+	if (write_padded(t->fd, NULL, 0, TRAILER_SIZE, 0) < 0)
+		goto write_err;
+	if (t->regular) {
+		t->offset = start;
+		if (uboot_env_extend_target(t) < 0) {
+			err("Can't resize target image file '%s': %s\n", t->name,
+					strerror(errno));
+			goto out;
+		}
+		if (uboot_env_pad_target(t, start + t->size - pad, pad) < 0)
+			goto write_err;
+	} else if (write_padded(t->fd, NULL, 0, pad, t->pad) < 0)
+		goto write_err;
+
+	if (pwrite(t->fd, hdr, CRC32_SIZE, start) != CRC32_SIZE)
+		goto write_err;
+
+	ret = 0;
+	goto out;
+
+write_err:
+	err("Can't write to target image file '%s': %s\n", t->name,
+			strerror(errno));
+out:
+	if (ret)
+		uboot_env_discard_target(t);
+	decomp_close(d);
+	free(out);
+	free(in);
+	return ret;
+}
+
+/*
+ * Move the len bytes of text at start of regular target t by one byte, to
+ * the front (dropping the first one) or back (making room for one), using
+ * buf of STREAM_CHUNK_SIZE bytes.
+ */
+static int uboot_env_shift_text(struct file *t, off_t start, size_t len,
+				bool back, uint8_t *buf)
+{
+	size_t m = back ? len : len - 1, off, n;
+	off_t pos;
+
+	for (off = 0; off < m; off += n) {
+		n = m - off < STREAM_CHUNK_SIZE ? m - off : STREAM_CHUNK_SIZE;
+		/* moving back, start at the end so nothing is overwritten */
+		pos = start + (off_t) (back ? m - off - n : off + 1);
+		if (pread(t->fd, buf, n, pos) != (ssize_t) n ||
+		    pwrite(t->fd, buf, n, back ? pos + 1 : pos - 1) != (ssize_t) n)
+			return -1;
+	}
+
+	return back ? 0 : ftruncate(t->fd, start + (off_t) m);
+}
+
+/*
+ * Streaming variant of uboot_img_to_env(). The text is written while the
+ * image is read, so whether there is a flags byte has to be guessed up front
+ * using env_looks_like_flags(). If the CRC32 at the end tells otherwise, the
+ * text in a regular target is corrected: without flags byte, it only differs
+ * by the flags byte in front, unless it is empty.
+ */
+static int uboot_img_stream_to_env(struct file *s, struct file *t,
+				   unsigned int flags)
+{
+	bool redundant = flags & ENV_REDUNDANT, no_flags = flags & ENV_NO_FLAGS;
+	uint8_t hdr[CRC32_SIZE + FLAGS_SIZE];
+	uint8_t *in, *out;
+	uint32_t img_crc, crc, crc_flags = 0;
+	size_t len, data_end, data_size = 0, pending = 0, remaining = SIZE_MAX;
+	bool found_data_end = false, has_flags, want_flags;
+	int first = -1;		/* the first byte after the flags byte */
+	ssize_t n;
+	int ret = -1;
+
+	/* read at most s->size bytes if set */
+	if (s->size > 0 && s->size < remaining)
+		remaining = s->size;
+
+	n = read_full(s->fd, hdr, sizeof(hdr));
+	if (n < 0) {
+		err("Can't read from source file '%s': %s\n", s->name,
+				strerror(errno));
+		return -1;
+	}
+	if ((size_t) n < sizeof(hdr) || remaining < sizeof(hdr)) {
+		err("Source image '%s' is too small\n", s->name);
+		return -1;
+	}
+	remaining -= sizeof(hdr);
+	img_crc = env_load_crc(hdr, flags);
+	has_flags = !no_flags &&
+		    (redundant || env_looks_like_flags(hdr[CRC32_SIZE]));
+
+	if (uboot_env_open_target(t))
+		return -1;
+
+	in = malloc(STREAM_CHUNK_SIZE + 1);
+	out = malloc(STREAM_CHUNK_SIZE + 1);
+	if (!in || !out) {
+		err("Can't allocate stream buffer\n");
+		goto out;
+	}
+
+	/* without flags byte, it's the first data byte */
+	if (!has_flags)
+		in[pending++] = hdr[CRC32_SIZE];
+
+	/*
+	 * in[] starts with at most one pending byte from the previous chunk,
+	 * a NUL which might be the first byte of the terminator
+	 */
+	while ((n = read_full(s->fd, in + pending, remaining < STREAM_CHUNK_SIZE ?
+					remaining : STREAM_CHUNK_SIZE)) > 0) {
+		remaining -= n;
+		crc_flags = crc32_update(crc_flags, in + pending, n);
+		if (data_size == 0)
+			first = in[pending];
+		data_size += n;
+		if (found_data_end)
+			continue;
+
+		len = pending + n;
+		data_end = find_double_nul(in, len);
+		if (data_end < len)
+			found_data_end = true;
+		else if (in[len - 1] == '\0')
+			data_end = len - 1;
+
+		convert(out, in, data_end, '\0', '\n');
+		if (write_padded(t->fd, out, data_end, 0, 0) < 0)
+			goto write_err;
+		t->size += data_end;
+
+		pending = len - data_end;
+		if (found_data_end || pending == 0)
+			pending = 0;
+		else
+			in[0] = '\0';
+	}
+	if (n < 0) {
+		err("Can't read from source file '%s': %s\n", s->name,
+				strerror(errno));
+		goto out;
+	}
+
+	/* the sizes of what was read and written, for --stats */
+	s->size = sizeof(hdr) + data_size;
+	if (!found_data_end) {
+		if (pending > 0 && write_padded(t->fd, (const uint8_t *) "\n", 1, 0, 0) < 0)
+			goto write_err;
+		t->size += pending > 0;
+	}
+
+	crc = crc32_combine_len(crc32_update(0, hdr + CRC32_SIZE, FLAGS_SIZE),
+				crc_flags, data_size);
+	/* as in env_check(), no flags byte only if the CRC32 matches without */
+	want_flags = !no_flags && (redundant || img_crc != crc);
+	/* neither matches, keep the guess if the text can't be corrected */
+	if (!t->regular && img_crc != crc_flags && want_flags)
+		want_flags = has_flags;
+
+	if (has_flags && !want_flags) {
+		if (hdr[CRC32_SIZE] == '\0' && first == '\0') {
+			/* empty, the two null bytes follow the CRC32 */
+			if (t->size > 0 && (!t->regular || ftruncate(t->fd, 0) < 0))
+				goto layout_err;
+			t->size = 0;
+			found_data_end = true;
+		} else {
+			/* the flags byte is the first data byte */
+			if (!t->regular ||
+			    uboot_env_shift_text(t, 0, t->size, true, out) < 0 ||
+			    pwrite(t->fd, hdr[CRC32_SIZE] ? hdr + CRC32_SIZE :
+				   (const uint8_t *) "\n", 1, 0) != 1)
+				goto layout_err;
+			t->size++;
+		}
+	} else if (!has_flags && want_flags) {
+		/* the first data byte is the flags byte */
+		if (!t->regular ||
+		    uboot_env_shift_text(t, 0, t->size, false, out) < 0)
+			goto layout_err;
+		t->size--;
+	}
+	if (!found_data_end)
+		warn("No end of list delimiter found in source file\n");
+	if (img_crc != (want_flags ? crc_flags : crc))
+		warn("source image with bad CRC.\n");
+
+	ret = 0;
+	goto out;
+
+layout_err:
+	if (t->regular)
+		goto write_err;
+	err("Source image '%s' has %s flags byte, which can't be corrected in "
+	    "target '%s', %s\n", s->name, want_flags ? "a" : "no", t->name,
+	    want_flags ? "use -R or write to a regular file" :
+			 "use --no-flag or write to a regular file");
+	goto out;
+
+write_err:
+	err("Can't write to target image file '%s': %s\n", t->name,
+			strerror(errno));
+out:
+	if (ret)
+		uboot_env_discard_target(t);
+	free(out);
+	free(in);
+	return ret;
+}
+
+/* one --set or --unset operation */
+struct env_edit {
+	const char *name;
+	size_t name_len;
+	const char *value;	/* NULL to unset */
+};
+
+/*
+ * Find the record defining name in the NUL separated records buf[0..len),
+ * returning its offset and storing its size including the NUL in *rec_len.
+ */
+static ssize_t env_find_record(const uint8_t *buf, size_t len, const char *name,
+			       size_t name_len, size_t *rec_len)
+{
+	const uint8_t *p, *e, *end = buf + len;
+
+	for (p = buf; p < end; p = e + 1) {
+		e = memchr(p, '\0', end - p);
+		if (!e)
+			e = end;
+		if ((size_t) (e - p) > name_len && p[name_len] == '=' &&
+		    memcmp(p, name, name_len) == 0) {
+			*rec_len = e - p + 1;
+			return p - buf;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Apply set/unset operations to a binary image in place, following U-Boot's
+ * semantics: an existing definition is deleted, shifting the remaining ones
+ * to the front, and the new one is appended.
+ *
+ * Only the window of the data area from the first modified byte up to the
+ * end of the longer of the old and new list is hashed, before and after the
+ * modification. Since the CRC32 is linear, the CRC32 of the image changes by
+ * the difference of these two, shifted over the remaining bytes. An image
+ * with a bad CRC32 thus keeps a bad CRC32.
+ */
+static int uboot_env_edit_img(const char *name, const struct env_edit *edits,
+			      size_t nedits, const struct env_opts *o)
+{
+	struct file f;
+	struct stat sbuf;
+	uint8_t *data, *buf = NULL;
+	size_t data_size, used, old_end, new_end, lo, hi, rec_len, i;
+	size_t buf_size;
+	ssize_t off;
+	uint32_t img_crc, crc_old, crc_new;
+	size_t flags_size;
+	int ret = -1;
+
+	uboot_env_init_file(&f);
+	f.name = name;
+	f.fd = open(name, O_RDWR);
+	if (f.fd < 0) {
+		err("Can't open image file '%s': %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(f.fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) {
+		err("Image file '%s' must be a regular file\n", name);
+		goto out;
+	}
+	f.offset = o->offset;
+	f.size = o->img_size > 0 ? o->img_size : (size_t) (sbuf.st_size - f.offset);
+	if (f.offset > sbuf.st_size || f.offset + f.size > (size_t) sbuf.st_size ||
+	    f.size < CRC32_SIZE + FLAGS_SIZE + TRAILER_SIZE) {
+		err("Image file '%s' is too small\n", name);
+		goto out;
+	}
+
+	f.ptr = uboot_env_mmap(&f, f.size, PROT_READ|PROT_WRITE);
+	if (f.ptr == MAP_FAILED) {
+		err("Can't mmap image file '%s': %s\n", name, strerror(errno));
+		goto out;
+	}
+
+	/*
+	 * Hashing the image to detect the flags byte would defeat the purpose,
+	 * except if it is ambiguous: two NUL bytes after the CRC32 are either
+	 * an empty list or a flags byte of 0 followed by an empty list.
+	 */
+	if (o->redundant)
+		flags_size = FLAGS_SIZE;
+	else if (f.ptr[CRC32_SIZE] == '\0' && f.ptr[CRC32_SIZE + 1] == '\0') {
+		uint32_t crc_flags = crc32_parallel(0, f.ptr + CRC32_SIZE + FLAGS_SIZE,
+						    f.size - CRC32_SIZE - FLAGS_SIZE);
+
+		img_crc = env_load_crc(f.ptr, o->endian);
+		flags_size = img_crc == crc_flags ? FLAGS_SIZE : 0;
+	} else
+		flags_size = env_looks_like_flags(f.ptr[CRC32_SIZE]) ? FLAGS_SIZE : 0;
+	data = f.ptr + CRC32_SIZE + flags_size;
+	data_size = f.size - CRC32_SIZE - flags_size;
+
+	used = find_double_nul(data, data_size);
+	if (used == data_size) {
+		err("No end of list delimiter found in image file '%s'\n", name);
+		goto out;
+	}
+	/* end of the records including their NUL, the list end NUL follows */
+	old_end = used > 0 ? used + 1 : 0;
+
+	/* apply all edits to a copy of the records */
+	buf_size = old_end;
+	for (i = 0; i < nedits; i++) {
+		if (edits[i].value)
+			buf_size += edits[i].name_len + 1 + strlen(edits[i].value) + 1;
+	}
+	buf = malloc(buf_size > 0 ? buf_size : 1);
+	if (!buf) {
+		err("Can't allocate edit buffer\n");
+		goto out;
+	}
+	memcpy(buf, data, old_end);
+	new_end = old_end;
+
+	for (i = 0; i < nedits; i++) {
+		const struct env_edit *e = &edits[i];
+
+		while ((off = env_find_record(buf, new_end, e->name, e->name_len,
+					      &rec_len)) >= 0) {
+			memmove(buf + off, buf + off + rec_len, new_end - off - rec_len);
+			new_end -= rec_len;
+		}
+
+		if (e->value) {
+			size_t value_len = strlen(e->value);
+
+			memcpy(buf + new_end, e->name, e->name_len);
+			new_end += e->name_len;
+			buf[new_end++] = '=';
+			memcpy(buf + new_end, e->value, value_len);
+			new_end += value_len;
+			buf[new_end++] = '\0';
+		}
+	}
+
+	if (new_end + TRAILER_SIZE > data_size) {
+		err("Not enough space in image file '%s', need %zu more bytes\n",
+		    name, new_end + TRAILER_SIZE - data_size);
+		goto out;
+	}
+
+	for (lo = 0; lo < old_end && lo < new_end && buf[lo] == data[lo]; lo++)
+		;
+	if (lo == old_end && lo == new_end) {
+		ret = 0;
+		goto out;
+	}
+	hi = (old_end > new_end ? old_end : new_end) + TRAILER_SIZE;
+	if (hi > data_size)
+		hi = data_size;
+
+	crc_old = crc32_update(0, data + lo, hi - lo);
+	memcpy(data + lo, buf + lo, new_end - lo);
+	memset(data + new_end, 0, hi - new_end);
+	crc_new = crc32_update(0, data + lo, hi - lo);
+
+	img_crc = env_load_crc(f.ptr, o->endian);
+	img_crc ^= crc32_combine_len(crc_old ^ crc_new, 0, data_size - hi);
+	env_store_crc(f.ptr, img_crc, o->endian);
+
+	ret = 0;
+out:
+	free(buf);
+	uboot_env_cleanup_file(&f);
+	return ret;
+}
+
+/* long options without short equivalent */
+enum {
+	OPT_BATCH = 256,
+	OPT_SET,
+	OPT_UNSET,
+	OPT_SLOTS,
+	OPT_OFFSET,
+	OPT_PAD,
+	OPT_UPDATE,
+	OPT_VERIFY,
+	OPT_GET,
+	OPT_STRIP_CR,
+	OPT_DUPLICATES,
+	OPT_RESIZE,
+	OPT_NO_FLAG,
+	OPT_ENDIAN,
+	OPT_STATS,
+	OPT_CACHE_DIR,
+	OPT_SCAN,
+	OPT_ALIGN,
+	OPT_CANONICAL,
+};
+
+static const char short_options[] = "s:f:i:rRnh";
+
+static const struct option long_options[] = {
+	{ "size",	required_argument,	NULL, 's' },
+	{ "flag",	required_argument,	NULL, 'f' },
+	{ "overlay",	required_argument,	NULL, 'i' },
+	{ "reverse",	no_argument,		NULL, 'r' },
+	{ "redundant",	no_argument,		NULL, 'R' },
+	{ "no-crc",	no_argument,		NULL, 'n' },
+	{ "batch",	required_argument,	NULL, OPT_BATCH },
+	{ "set",	required_argument,	NULL, OPT_SET },
+	{ "unset",	required_argument,	NULL, OPT_UNSET },
+	{ "slots",	no_argument,		NULL, OPT_SLOTS },
+	{ "offset",	required_argument,	NULL, OPT_OFFSET },
+	{ "pad",	required_argument,	NULL, OPT_PAD },
+	{ "update",	no_argument,		NULL, OPT_UPDATE },
+	{ "verify",	no_argument,		NULL, OPT_VERIFY },
+	{ "get",	required_argument,	NULL, OPT_GET },
+	{ "strip-cr",	no_argument,		NULL, OPT_STRIP_CR },
+	{ "warn-duplicates", no_argument,	NULL, OPT_DUPLICATES },
+	{ "resize",	no_argument,		NULL, OPT_RESIZE },
+	{ "no-flag",	no_argument,		NULL, OPT_NO_FLAG },
+	{ "endian",	required_argument,	NULL, OPT_ENDIAN },
+	{ "stats",	optional_argument,	NULL, OPT_STATS },
+	{ "cache-dir",	required_argument,	NULL, OPT_CACHE_DIR },
+	{ "scan",	no_argument,		NULL, OPT_SCAN },
+	{ "align",	required_argument,	NULL, OPT_ALIGN },
+	{ "canonical",	no_argument,		NULL, OPT_CANONICAL },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static void usage_and_exit(int status)
+{
+	printf("usage: mkubootenv [-s <size>] [-f <flag>] [-i <overlay>]... [-r [-R]] [-n]\n"
+	       "                  [--pad <byte>] [--offset <offset>] [--endian <big|little>]\n"
+	       "                  [--update] [--strip-cr] [--warn-duplicates] [--stats[=json]]\n"
+	       "                  [--cache-dir <dir>] [--canonical] <source file> <target file>\n"
+	       "       mkubootenv --resize [-R] [-s <size>] [-f <flag> | --no-flag] [-n]\n"
+	       "                  [--pad <byte>] [--offset <offset>] [--update] <source image>\n"
+	       "                  <target image>\n"
+	       "       mkubootenv [options] --batch <manifest>\n"
+	       "       mkubootenv [-R] [-s <size>] [--offset <offset>] --verify <image file>...\n"
+	       "       mkubootenv [-R] [-s <size>] [--align <align>] --scan <dump file>...\n"
+	       "       mkubootenv [-R] [-s <size>] [--offset <offset>] --get <name>[,<name>...]...\n"
+	       "                  <image file>\n"
+	       "       mkubootenv [-R] [--set <name>=<value>]... [--unset <name>]... <image file>\n"
+	       "       mkubootenv [-s <size>] [-i <overlay>]... [-n] [--pad <byte>]\n"
+	       "                  [--offset <offset>[,<offset>]] [--update] --slots <source file>\n"
+	       "                  <slot A> <slot B>\n"
+	       "  -s, --size <size>  set size of the target image file to <size> bytes. If <size>\n"
+	       "                     is bigger than the source file, the target image gets padded\n"
+	       "                     with null bytes. If <size> is smaller than the source file,\n"
+	       "                     an error is emitted.\n"
+	       "  --pad <byte>       pad the target image with <byte>, 0x00 (default) or 0xff for\n"
+	       "                     erased flash.\n"
+	       "  -f, --flag <flag>  set this flag if you are using redundant environments. Set\n"
+	       "                     <flag> to 1 for active environment or <flag> 0 for obsolete\n"
+	       "                     environment. If using reverse operation, the value given with\n"
+	       "                     option -f is ignored.\n"
+	       "  -i, --overlay <overlay>  merge the variables from env file <overlay> into the\n"
+	       "                     source before conversion. May be given multiple times, the\n"
+	       "                     last definition of a variable wins, name= deletes it.\n"
+	       "  -r, --reverse      reverse operation: get plaintext env file (target) from binary\n"
+	       "                     image file (source)\n"
+	       "  -R, --redundant    for reverse operation, the source image is a redundant\n"
+	       "                     environment containing a flags byte. Skips auto-detection of\n"
+	       "                     the flags byte.\n"
+	       "  -n, --no-crc       do not calculate CRC32. CRC32 is filled with zeros. For reverse\n"
+	       "                     operation, this option is ignored\n"
+	       "  --endian <big|little>  byte order of the CRC32 in binary images, that of the\n"
+	       "                     target board's CPU. Defaults to the host's byte order.\n"
+	       "  --batch <manifest> convert all source/target pairs listed in <manifest>, one\n"
+	       "                     per line, using a thread per CPU. Lines are of the form\n"
+	       "                     <source> <target> [size=<size>] [flag=<0|1>] [pad=<byte>]\n"
+	       "                     [nocrc] [offset=<offset>] [endian=<big|little>] [update]\n"
+	       "                     [strip-cr]\n"
+	       "                     [warn-duplicates] [canonical] [reverse] [redundant] [resize]\n"
+	       "                     [noflag]\n"
+	       "                     [overlay=<file>]...\n"
+	       "                     options default to the given ones.\n"
+	       "  --slots            write the redundant environment created from <source file>\n"
+	       "                     as active one to the inactive one of <slot A> and <slot B>,\n"
+	       "                     then mark the other one obsolete. With --offset A,B the\n"
+	       "                     slots are at different offsets, e.g. of one MTD device.\n"
+	       "  --set <name>=<value>  set variable <name> in <image file> in place. May be\n"
+	       "                     given multiple times.\n"
+	       "  --unset <name>     delete variable <name> from <image file> in place. May be\n"
+	       "                     given multiple times.\n"
+	       "  --offset <offset>  the binary image is located at <offset> in the target file\n"
+	       "                     (source file in reverse mode or image file with --set and\n"
+	       "                     --unset), which is written in place and never truncated.\n"
+	       "                     In reverse mode, -s gives the size of the image.\n"
+	       "  --update           compare the image with the existing target file and only\n"
+	       "                     rewrite the blocks which differ\n"
+	       "  --strip-cr         remove carriage returns at the end of source file lines\n"
+	       "  --warn-duplicates  warn about variables defined more than once in the source\n"
+	       "                     file\n"
+	       "  --canonical        sort the variables by name and drop all but the last\n"
+	       "                     definition of each, so the same variables always give\n"
+	       "                     the same image\n"
+	       "  --get <name>[,<name>...]  print the given variables of <image file> as\n"
+	       "                     name=value lines. May be given multiple times.\n"
+	       "  --verify           only check the CRC32 and the end of the data of the given\n"
+	       "                     image files in parallel and print the results as JSON\n"
+	       "  --scan             find the images in the given flash dumps, at multiples of\n"
+	       "                     --align <align> (default 512) bytes and of size -s if\n"
+	       "                     given, and print offset, size, flags and validity as JSON\n"
+	       "  --resize           convert binary <source image> into <target image> of\n"
+	       "                     another size (-s, default the size of <source image>)\n"
+	       "                     without going through text. Keeps the flags byte unless\n"
+	       "                     -f or --no-flag is given.\n"
+	       "  --no-flag          remove the flags byte when resizing, in reverse mode:\n"
+	       "                     <source image> has no flags byte\n"
+	       "  --cache-dir <dir>  copy the target from cache directory <dir> if it has been\n"
+	       "                     created from the same source with the same options before,\n"
+	       "                     otherwise add it\n"
+	       "  --stats[=json]     print the time and page faults of each phase, the bytes\n"
+	       "                     processed and the kernels and I/O paths used to stderr,\n"
+	       "                     for --batch and --verify also percentiles over all jobs\n"
+	       "  -h, --help         show this help and exit\n"
+	       "Use - as <source file> or <target file> to read from stdin or write to stdout.\n"
+	       "gzip or zstd compressed source files are decompressed while they are read.\n"
+	       "MTD devices (/dev/mtdN) are written directly, erasing only changed blocks.\n");
+	exit(status);
+}
+
+/* get the parsed base environment from file name, loading it on first use */
+static struct base_env *base_env_get(const char *name)
+{
+	struct base_env *b;
+
+	pthread_mutex_lock(&base_envs_lock);
+	for (b = base_envs; b; b = b->next) {
+		if (strcmp(b->f.name, name) == 0)
+			goto out;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		err("Can't allocate base environment\n");
+		goto out;
+	}
+	uboot_env_init_file(&b->f);
+	env_index_init(&b->idx);
+	b->f.name = strdup(name);
+	if (!b->f.name || uboot_env_prepare_source(&b->f))
+		goto err;
+	if (!b->f.regular) {
+		err("Source file '%s' must be a regular file to use overlays or "
+		    "--canonical\n", name);
+		goto err;
+	}
+	if (decomp_detect(b->f.ptr, b->f.size) != DECOMP_NONE) {
+		err("Source file '%s' must be uncompressed to use overlays or "
+		    "--canonical\n", name);
+		goto err;
+	}
+	if (env_index_parse(&b->idx, b->f.ptr, b->f.size, '\n', false)) {
+		err("Can't allocate index for source file '%s'\n", name);
+		goto err;
+	}
+
+	b->next = base_envs;
+	base_envs = b;
+out:
+	pthread_mutex_unlock(&base_envs_lock);
+	return b;
+
+err:
+	uboot_env_cleanup_file(&b->f);
+	free((char *) b->f.name);
+	env_index_free(&b->idx);
+	free(b);
+	b = NULL;
+	goto out;
+}
+
+static void base_env_free_all(void)
+{
+	struct base_env *b;
+
+	while ((b = base_envs) != NULL) {
+		base_envs = b->next;
+		uboot_env_cleanup_file(&b->f);
+		free((char *) b->f.name);
+		env_index_free(&b->idx);
+		free(b);
+	}
+}
+
+static inline uint8_t *env_var_emit(uint8_t *p, const struct env_var *v)
+{
+	memcpy(p, v->name, v->name_len);
+	p += v->name_len;
+	*p++ = '=';
+	memcpy(p, v->value, v->value_len);
+	p += v->value_len;
+	*p++ = '\n';
+
+	return p;
+}
+
+/*
+ * Merge the overlays from o into the base environment and store the resulting
+ * text in a buffer at s->ptr. The last definition of a variable wins, "name="
+ * in an overlay deletes the variable. Variables keep the position of their
+ * first definition in the base environment, new ones are appended in the
+ * order of the overlays. With --canonical, they are sorted by name instead,
+ * so the same variables always give the same image. Only the overlays are
+ * parsed, the base environment is indexed once.
+ */
+static int uboot_env_merge(struct file *s, const struct base_env *base,
+			   const struct env_opts *o)
+{
+	struct file *ovl;
+	struct env_index idx;
+	const struct env_var *v, *w, **vars = NULL;
+	size_t i, n = 0, nvars, size = base->f.size + base->idx.nvars;
+	uint8_t *p;
+	int ret = -1;
+
+	ovl = calloc(o->noverlays, sizeof(*ovl));
+	if (!ovl) {
+		err("Can't allocate overlays\n");
+		return -1;
+	}
+	env_index_init(&idx);
+
+	for (i = 0; i < o->noverlays; i++) {
+		uboot_env_init_file(&ovl[i]);
+		ovl[i].name = o->overlays[i];
+		if (uboot_env_prepare_source(&ovl[i]))
+			goto out;
+		if (!ovl[i].regular) {
+			err("Overlay file '%s' must be a regular file\n", ovl[i].name);
+			goto out;
+		}
+		if (env_index_parse(&idx, ovl[i].ptr, ovl[i].size, '\n', true)) {
+			err("Can't allocate index for overlay file '%s'\n", ovl[i].name);
+			goto out;
+		}
+		size += ovl[i].size;
+	}
+	size += idx.nvars;
+	nvars = base->idx.nvars + idx.nvars;
+
+	/* the variables in order, followed by room for sorting them */
+	vars = malloc((nvars > 0 ? nvars : 1) * (o->canonical ? 2 : 1) *
+		      sizeof(*vars));
+	/* upper bound, every variable might be missing its newline */
+	s->ptr = malloc(size > 0 ? size : 1);
+	if (!vars || !s->ptr) {
+		err("Can't allocate buffer for merged source file '%s'\n", s->name);
+		goto out;
+	}
+	s->buffered = true;
+	s->regular = true;
+
+	for (i = 0; i < base->idx.nvars; i++) {
+		v = &base->idx.vars[i];
+		w = env_index_find(&idx, v->name, v->name_len);
+		if (!w)
+			w = v;
+		if (w->value)
+			vars[n++] = w;
+	}
+	for (i = 0; i < idx.nvars; i++) {
+		w = &idx.vars[i];
+		if (w->value && !env_index_find(&base->idx, w->name, w->name_len))
+			vars[n++] = w;
+	}
+	if (o->canonical)
+		env_var_sort(vars, n, vars + nvars);
+
+	p = s->ptr;
+	for (i = 0; i < n; i++)
+		p = env_var_emit(p, vars[i]);
+	s->size = p - s->ptr;
+	s->map_size = s->size;
+
+	ret = 0;
+out:
+	for (i = 0; i < o->noverlays; i++)
+		uboot_env_cleanup_file(&ovl[i]);
+	free(ovl);
+	free(vars);
+	env_index_free(&idx);
+	return ret;
+}
+
+/*
+ * Open the source file of a forward or reverse conversion and apply overlays
+ * or sort it for --canonical.
+ */
+static int uboot_env_load_source(struct file *s, const struct env_opts *o)
+{
+	if ((o->noverlays > 0 || o->canonical) && !o->reverse && !o->resize) {
+		const struct base_env *base = base_env_get(s->name);
+
+		return (base && uboot_env_merge(s, base, o) == 0) ? 0 : -1;
+	}
+
+	return uboot_env_prepare_source(s);
+}
+
+/*
+ * Get the size of the image to create from source s, either img_size if set
+ * or the minimum size. Returns 0 if the source doesn't fit into img_size.
+ */
+static size_t uboot_env_img_size(const struct file *s, size_t img_size,
+				 size_t flags_size)
+{
+	size_t min_img_size = CRC32_SIZE + flags_size + s->size + TRAILER_SIZE;
+
+	/*
+	 * check whether the size hasn't been set or whether the source file +
+	 * CRC + trailer fits into the specified size.
+	 */
+	if (img_size == 0)
+		return min_img_size;
+
+	if (img_size < min_img_size) {
+		err("Specified size (%zu) is too small for the source"
+		    "file to fit into. Must be at least %zu bytes.\n",
+		    img_size, min_img_size);
+		return 0;
+	}
+
+	return img_size;
+}
+
+/*
+ * Path of the cached target for source s converted with options o: the XXH64
+ * hash over the options which change the target or the checks of the source
+ * and the source data, which is mapped or merged already. The target itself
+ * is never hashed, so a lookup costs a single pass over the source. A hit
+ * isn't verified against the source, collisions of the 64 bit hash (a chance
+ * of about n^2 / 2^65 among n cached targets) are accepted.
+ */
+static int uboot_env_cache_key(const struct file *s, const struct env_opts *o,
+			       char *path, size_t size)
+{
+	struct {
+		char magic[8];
+		uint64_t img_size;
+		uint64_t src_size;
+		uint8_t mode;
+		uint8_t flags;
+		uint8_t flags_size;
+		uint8_t do_crc;
+		uint8_t pad;
+		uint8_t big_endian;
+		uint8_t strip_cr;
+		uint8_t redundant;
+		uint8_t no_flag;
+		uint8_t duplicates;
+	} key;
+	uint64_t h;
+	int n;
+
+	/* no padding bytes of undefined value */
+	memset(&key, 0, sizeof(key));
+	/* bump the version if the output for the same options ever changes */
+	memcpy(key.magic, "envimg01", sizeof(key.magic));
+	key.img_size = o->img_size;
+	key.src_size = s->size;
+	key.mode = o->reverse ? 1 : o->resize ? 2 : 0;
+	key.flags = o->flags;
+	key.flags_size = o->flags_size;
+	key.do_crc = o->do_crc;
+	key.pad = o->pad;
+	key.big_endian = env_big_endian(o->endian);
+	key.strip_cr = o->strip_cr;
+	key.redundant = o->redundant;
+	key.no_flag = o->no_flag;
+	key.duplicates = o->duplicates;
+
+	h = xxh64(&key, sizeof(key), 0);
+	h = xxh64(s->ptr, s->size, h);
+	n = snprintf(path, size, "%s/%016" PRIx64, o->cache_dir, h);
+
+	return n < 0 || (size_t) n >= size ? -1 : 0;
+}
+
+/*
+ * Copy regular file in to the empty file out, as reflink if supported. The
+ * holes of in are kept when copying by hand.
+ */
+static int copy_file(int in, int out)
+{
+	uint8_t buf[64 * 1024];
+	struct stat sbuf;
+	size_t left;
+	off_t off, data, hole;
+	ssize_t n = 0;
+
+	if (ioctl(out, FICLONE, in) == 0)
+		return 0;
+
+	if (fstat(in, &sbuf) < 0)
+		return -1;
+	for (left = sbuf.st_size; left > 0; left -= n) {
+		n = copy_file_range(in, NULL, out, NULL, left, 0);
+		if (n <= 0)
+			break;
+	}
+	if (left > 0 && n < 0 && errno != EXDEV && errno != ENOSYS &&
+	    errno != EINVAL && errno != EOPNOTSUPP)
+		return -1;
+
+	/* not supported or not across filesystems, go on by hand */
+	for (off = sbuf.st_size - left; off < sbuf.st_size; off = hole) {
+		data = lseek(in, off, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;	/* a hole up to the end */
+		hole = data < 0 ? -1 : lseek(in, data, SEEK_HOLE);
+		/* holes not supported, copy all of the rest */
+		if (hole < 0) {
+			data = off;
+			hole = sbuf.st_size;
+		}
+		if (hole > sbuf.st_size)
+			hole = sbuf.st_size;
+
+		for (; data < hole; data += n) {
+			n = pread(in, buf, (size_t) (hole - data) < sizeof(buf) ?
+				  (size_t) (hole - data) : sizeof(buf), data);
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (n <= 0) {
+				if (n == 0)
+					errno = EIO;	/* shrunk while copying */
+				return -1;
+			}
+			if (lseek(out, data, SEEK_SET) < 0 ||
+			    write_padded(out, buf, n, 0, 0) < 0)
+				return -1;
+		}
+	}
+
+	/* the holes at the end */
+	return ftruncate(out, sbuf.st_size);
+}
+
+/* whether the target of a conversion with options o may come from the cache */
+static bool uboot_env_cacheable(const struct file *s, const char *target,
+				const struct env_opts *o)
+{
+	struct stat sbuf;
+
+	if (!o->cache_dir || !s->regular || is_stdio(target) || o->in_place ||
+	    o->update)
+		return false;
+
+	/* devices aren't written by copying, MTD devices need erasing */
+	return stat(target, &sbuf) < 0 || S_ISREG(sbuf.st_mode);
+}
+
+/*
+ * Copy the cached target at path to target and store its size in *size.
+ * Returns -1 if it isn't cached or the copy failed, to convert it instead.
+ */
+static int uboot_env_cache_fetch(const char *path, const char *target,
+				 size_t *size)
+{
+	struct stat sbuf;
+	int in, out, ret = -1;
+
+	in = open(path, O_RDONLY);
+	if (in < 0) {
+		if (errno != ENOENT)
+			warn("Can't open cached image '%s': %s\n", path,
+			     strerror(errno));
+		return -1;
+	}
+	/* let the conversion report any errors */
+	out = open(target, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (out < 0)
+		goto out;
+
+	if (copy_file(in, out) == 0 && fstat(out, &sbuf) == 0)
+		ret = 0;
+	if (close(out) < 0)
+		ret = -1;
+	if (ret < 0) {
+		warn("Can't copy cached image '%s' to '%s': %s\n", path,
+		     target, strerror(errno));
+		goto out;
+	}
+	*size = sbuf.st_size;
+out:
+	close(in);
+	return ret;
+}
+
+/*
+ * Add the target just written to the cache as path. It is copied to a
+ * temporary file first and renamed, so concurrent lookups (e.g. of other
+ * batch jobs or processes) never see a partial image. Failures only cost
+ * the next lookup.
+ */
+static void uboot_env_cache_store(const char *dir, const char *path,
+				  const char *target)
+{
+	char tmp[PATH_MAX];
+	int in, out = -1, n;
+
+	n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if (n < 0 || (size_t) n >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+	out = mkstemp(tmp);
+	if (out < 0 && errno == ENOENT && mkdir(dir, 0777) == 0) {
+		strcpy(tmp + n - 6, "XXXXXX");
+		out = mkstemp(tmp);
+	}
+	if (out < 0)
+		goto err;
+
+	in = open(target, O_RDONLY);
+	if (in < 0)
+		goto err_unlink;
+	if (copy_file(in, out) < 0) {
+		close(in);
+		goto err_unlink;
+	}
+	close(in);
+	if (fchmod(out, 0644) < 0 || close(out) < 0) {
+		out = -1;
+		goto err_unlink;
+	}
+	out = -1;
+	if (rename(tmp, path) < 0)
+		goto err_unlink;
+
+	return;
+
+err_unlink:
+	n = errno;
+	unlink(tmp);
+	errno = n;
+err:
+	warn("Can't add '%s' to cache directory '%s': %s\n", target, dir,
+	     strerror(errno));
+	if (out >= 0)
+		close(out);
+}
+
+/* record the sizes and the I/O paths of a conversion for --stats */
+static void stats_files(struct env_stats *st, const struct file *s,
+			const struct file *t, const struct env_opts *o)
+{
+	if (!st)
+		return;
+
+	st->bytes_in = s->size;
+	st->bytes_out = t->size;
+	if ((o->noverlays > 0 || o->canonical) && !o->reverse && !o->resize)
+		st->source_backend = "merge";
+	else if (s->compressed)
+		st->source_backend = decomp_name(s->compressed);
+	else
+		st->source_backend = s->regular ? "mmap" : "stream";
+	if (t->mtd)
+		st->target_backend = "mtd";
+	else if (t->update)
+		st->target_backend = "update";
+	else if (!s->regular || s->compressed)
+		st->target_backend = "stream";
+	else
+		st->target_backend = t->buffered ? "write" : "mmap";
+}
+
+/*
+ * Convert one source file into a target file according to the given options,
+ * using buf (if set) for buffered targets. If st is set, the phases of the
+ * conversion are timed, see --stats.
+ */
+static int uboot_env_convert(const char *source, const char *target,
+			     const struct env_opts *o, struct buffer *buf,
+			     struct env_stats *st)
+{
+	int ret = -1;
+	struct file s, t;	/* source and target file */
+	char cache_path[PATH_MAX];
+	bool cached = false;
+
+	uboot_env_init_file(&s);
+	uboot_env_init_file(&t);
+	s.name = source;
+	t.name = target;
+	t.buf = buf;
+	t.update = o->update;
+	if (o->reverse) {
+		s.offset = o->offset;
+		s.size = o->img_size;
+	} else {
+		t.offset = o->offset;
+		t.keep = o->in_place;
+		t.pad = o->pad;
+	}
+
+	stats_start(st);
+	if (uboot_env_load_source(&s, o))
+		goto cleanup_source;
+	/* compressed text is decompressed into the chunks of the stream */
+	if (!o->reverse && !o->resize && s.regular)
+		s.compressed = decomp_detect(s.ptr, s.size);
+	stats_phase(st, STAT_SOURCE);
+
+	if (uboot_env_cacheable(&s, target, o) &&
+	    uboot_env_cache_key(&s, o, cache_path, sizeof(cache_path)) == 0) {
+		cached = true;
+		if (uboot_env_cache_fetch(cache_path, target, &t.size) == 0) {
+			stats_phase(st, STAT_CACHE);
+			stats_files(st, &s, &t, o);
+			if (st)
+				st->target_backend = "cache";
+			ret = 0;
+			goto cleanup_source;
+		}
+		stats_phase(st, STAT_CACHE);
+	}
+
+	if (!s.regular && o->resize) {
+		err("Source image file '%s' must be a regular file\n", s.name);
+		goto cleanup_source;
+	}
+	if (!s.regular || s.compressed) {
+		if (o->reverse)
+			ret = uboot_img_stream_to_env(&s, &t, uboot_img_flags(o));
+		else
+			ret = uboot_env_stream_to_img(&s, &t, o);
+		stats_phase(st, STAT_CONVERT);
+		goto cleanup_target;
+	}
+
+	if (o->resize) {
+		if (uboot_img_resize(&s, &t, o, st))
+			goto cleanup_source;
+	} else if (!o->reverse) {
+		t.size = uboot_env_img_size(&s, o->img_size, o->flags_size);
+		if (t.size == 0)
+			goto cleanup_source;
+
+		/* the trailer is written along with non-zero padding */
+		if (uboot_env_prepare_target(&t, CRC32_SIZE + o->flags_size + s.size +
+					     (t.pad ? TRAILER_SIZE : 0)))
+			goto cleanup_source;
+		stats_phase(st, STAT_TARGET);
+
+		if (uboot_env_to_img(&s, &t, o->flags, o->flags_size, o))
+			goto cleanup_source;
+		stats_phase(st, STAT_CONVERT);
+	} else {
+		if (uboot_img_to_env(&s, &t, uboot_img_flags(o), st))
+			goto cleanup_source;
+	}
+
+	if (uboot_env_flush_target(&t))
+		goto cleanup_target;
+
+	ret = 0;
+
+cleanup_target:
+	if (ret == 0 && o->sync && uboot_env_sync_target(&t))
+		ret = -1;
+	stats_files(st, &s, &t, o);
+	uboot_env_cleanup_file(&t);
+	stats_phase(st, STAT_FLUSH);
+	/* a hit would skip the warnings, so warn again next time */
+	if (ret == 0 && cached && s.nwarnings == 0) {
+		uboot_env_cache_store(o->cache_dir, cache_path, target);
+		stats_phase(st, STAT_CACHE);
+	}
+cleanup_source:
+	uboot_env_cleanup_file(&s);
+
+	return ret;
+}
+
+/* flags byte values of redundant environments */
+#define FLAG_OBSOLETE		0
+#define FLAG_ACTIVE		1
+
+/*
+ * Update a redundant environment stored in two slots, i.e. two files or
+ * devices or two offsets in one of them: write the new image to the inactive
+ * slot and make it the active one. As in U-Boot, the new image is written
+ * with the active flag like any other target (at its offset, erasing MTD
+ * devices as needed) and synced. Only then the flags byte of the previously
+ * active slot is set to obsolete, which on NOR flash only clears bits and
+ * needs no erase. If the update is interrupted at any point, at least one
+ * slot is marked active and holds a complete image.
+ */
+static int uboot_env_write_slots(const char *source, const char *slot_a,
+				 const char *slot_b, const struct env_opts *o)
+{
+	const char *name[2] = { slot_a, slot_b };
+	off_t offset[2] = { o->offset, o->offset_b >= 0 ? o->offset_b : o->offset };
+	size_t img_size = o->img_size;
+	struct stat sbuf[2];
+	uint8_t flag[2];
+	bool exists[2], same;
+	struct env_opts so;
+	struct file t;
+	int i, fd, new, ret = -1;
+
+	for (i = 0; i < 2; i++) {
+		/* a new slot file is never the active one */
+		flag[i] = FLAG_OBSOLETE;
+		fd = open(name[i], O_RDONLY);
+		exists[i] = fd >= 0;
+		if (fd < 0) {
+			if (errno == ENOENT)
+				continue;
+			err("Can't open slot image file '%s': %s\n", name[i],
+					strerror(errno));
+			return -1;
+		}
+		if (fstat(fd, &sbuf[i]) < 0 ||
+		    pread(fd, &flag[i], FLAGS_SIZE, offset[i] + CRC32_SIZE) < 0) {
+			err("Can't read slot image file '%s': %s\n", name[i],
+					strerror(errno));
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		if (o->img_size == 0 && S_ISREG(sbuf[i].st_mode) &&
+		    sbuf[i].st_size > offset[i] &&
+		    (size_t) (sbuf[i].st_size - offset[i]) > img_size)
+			img_size = sbuf[i].st_size - offset[i];
+	}
+
+	same = strcmp(name[0], name[1]) == 0 ||
+	       (exists[0] && exists[1] && sbuf[0].st_dev == sbuf[1].st_dev &&
+		sbuf[0].st_ino == sbuf[1].st_ino);
+	if (same && o->img_size == 0) {
+		err("Size of slots in the same file unknown, use -s\n");
+		return -1;
+	}
+	if (img_size == 0) {
+		err("Size of the slot images unknown, use -s\n");
+		return -1;
+	}
+	if (same && offset[0] < offset[1] + (off_t) img_size &&
+	    offset[1] < offset[0] + (off_t) img_size) {
+		err("Slots in the same file overlap, use --offset <A>,<B>\n");
+		return -1;
+	}
+
+	/* prefer the second slot if the flags don't tell */
+	if (flag[0] == FLAG_ACTIVE && flag[1] != FLAG_ACTIVE)
+		new = 1;
+	else if (flag[1] == FLAG_ACTIVE && flag[0] != FLAG_ACTIVE)
+		new = 0;
+	else
+		new = 1;
+
+	so = *o;
+	so.img_size = img_size;
+	so.flags = FLAG_ACTIVE;
+	so.flags_size = FLAGS_SIZE;
+	so.offset = offset[new];
+	so.cache_dir = NULL;
+	so.sync = true;
+	if (uboot_env_convert(source, name[new], &so, NULL, NULL))
+		return -1;
+	if (flag[!new] == FLAG_OBSOLETE)
+		return 0;
+
+	/* a single byte written in place, as MTD block update if need be */
+	uboot_env_init_file(&t);
+	t.name = name[!new];
+	t.offset = offset[!new] + CRC32_SIZE;
+	t.size = FLAGS_SIZE;
+	t.keep = true;
+	if (uboot_env_prepare_target(&t, FLAGS_SIZE))
+		return -1;
+	t.ptr[0] = FLAG_OBSOLETE;
+	if (uboot_env_flush_target(&t) == 0 && uboot_env_sync_target(&t) == 0)
+		ret = 0;
+	uboot_env_cleanup_file(&t);
+
+	return ret;
+}
+
+/* parse a size given in decimal or hexadecimal (0x prefix), 0 if invalid */
+static size_t parse_size(const char *str)
+{
+	if (strlen(str) > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+		return strtoul(str, NULL, 16);
+	else
+		return strtoul(str, NULL, 10);
+}
+
+/* parse a padding byte, only erased flash (0xff) and zeros make sense */
+static int parse_pad(const char *str, uint8_t *pad)
+{
+	size_t val = parse_size(str);
+
+	if (val != 0x00 && val != 0xff)
+		return -1;
+	*pad = val;
+	return 0;
+}
+
+static int parse_endian(const char *str, unsigned int *endian)
+{
+	if (strcmp(str, "big") == 0)
+		*endian = ENV_BIG_ENDIAN;
+	else if (strcmp(str, "little") == 0)
+		*endian = ENV_LITTLE_ENDIAN;
+	else
+		return -1;
+	return 0;
+}
+
+/* one line of a batch manifest */
+struct batch_job {
+	char *source;
+	char *target;
+	struct env_opts opts;
+	bool own_overlays;	/* opts.overlays allocated for this job */
+	int status;
+	struct env_info info;	/* result of --verify */
+	const char *error;
+	struct env_stats stats;
+};
+
+struct batch {
+	struct batch_job *jobs;
+	size_t njobs;
+	size_t next;		/* index of the next job to run, atomic */
+	bool quiet;		/* failures are reported per job */
+	unsigned int stats;	/* STATS_TEXT or STATS_JSON to print --stats */
+};
+
+static int batch_job_add_overlay(struct batch_job *job, const char *name)
+{
+	const char **overlays;
+	size_t i;
+
+	overlays = malloc((job->opts.noverlays + 1) * sizeof(*overlays));
+	if (!overlays)
+		return -1;
+
+	/* the first overlay of a job copies the defaults */
+	for (i = 0; i < job->opts.noverlays; i++)
+		overlays[i] = job->own_overlays ? job->opts.overlays[i] :
+						  strdup(job->opts.overlays[i]);
+	overlays[i] = strdup(name);
+	if (job->own_overlays)
+		free(job->opts.overlays);
+	job->opts.overlays = overlays;
+	job->opts.noverlays++;
+	job->own_overlays = true;
+
+	for (i = 0; i < job->opts.noverlays; i++) {
+		if (!overlays[i])
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a batch manifest. Each non-empty line not starting with '#' is of the
+ * form
+ *
+ *   <source> <target> [size=<size>] [flag=<0|1>] [pad=<byte>] [offset=<offset>]
+ *                     [endian=<big|little>] [update] [strip-cr]
+ *                     [warn-duplicates] [canonical] [nocrc] [reverse]
+ *                     [redundant] [resize] [noflag] [overlay=<file>]...
+ *
+ * where the options default to the ones given on the command line. Overlays
+ * are added to the ones given on the command line.
+ */
+static int batch_parse(const char *manifest, const struct env_opts *defaults,
+		       struct batch *b)
+{
+	FILE *fp;
+	char *line = NULL, *tok, *save;
+	size_t line_size = 0, alloc = 0, lineno = 0;
+	struct batch_job *job;
+	int ret = -1;
+
+	fp = is_stdio(manifest) ? stdin : fopen(manifest, "r");
+	if (!fp) {
+		err("Can't open batch manifest '%s': %s\n", manifest,
+				strerror(errno));
+		return -1;
+	}
+
+	while (getline(&line, &line_size, fp) >= 0) {
+		lineno++;
+		tok = strtok_r(line, " \t\r\n", &save);
+		if (!tok || tok[0] == '#')
+			continue;
+
+		if (b->njobs == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			job = realloc(b->jobs, alloc * sizeof(*job));
+			if (!job) {
+				err("Can't allocate batch jobs\n");
+				goto out;
+			}
+			b->jobs = job;
+		}
+		job = &b->jobs[b->njobs];
+		memset(job, 0, sizeof(*job));
+		job->opts = *defaults;
+		job->source = strdup(tok);
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (!tok) {
+			free(job->source);
+			err("%s:%zu: Missing target file\n", manifest, lineno);
+			goto out;
+		}
+		job->target = strdup(tok);
+		b->njobs++;
+		if (!job->source || !job->target) {
+			err("Can't allocate batch jobs\n");
+			goto out;
+		}
+
+		while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			if (strncmp(tok, "size=", 5) == 0) {
+				job->opts.img_size = parse_size(tok + 5);
+				if (job->opts.img_size == 0) {
+					err("%s:%zu: Invalid target image size '%s'\n",
+					    manifest, lineno, tok + 5);
+					goto out;
+				}
+			} else if (strcmp(tok, "flag=0") == 0 || strcmp(tok, "flag=1") == 0) {
+				job->opts.flags = tok[5] - '0';
+				job->opts.flags_size = FLAGS_SIZE;
+			} else if (strncmp(tok, "pad=", 4) == 0) {
+				if (parse_pad(tok + 4, &job->opts.pad)) {
+					err("%s:%zu: Invalid padding byte '%s'\n",
+					    manifest, lineno, tok + 4);
+					goto out;
+				}
+			} else if (strncmp(tok, "offset=", 7) == 0) {
+				job->opts.offset = parse_size(tok + 7);
+				job->opts.in_place = true;
+			} else if (strcmp(tok, "update") == 0) {
+				job->opts.update = true;
+			} else if (strcmp(tok, "strip-cr") == 0) {
+				job->opts.strip_cr = true;
+			} else if (strcmp(tok, "warn-duplicates") == 0) {
+				job->opts.duplicates = true;
+			} else if (strcmp(tok, "canonical") == 0) {
+				job->opts.canonical = true;
+			} else if (strncmp(tok, "endian=", 7) == 0) {
+				if (parse_endian(tok + 7, &job->opts.endian)) {
+					err("%s:%zu: Invalid byte order '%s'\n",
+					    manifest, lineno, tok + 7);
+					goto out;
+				}
+			} else if (strcmp(tok, "resize") == 0) {
+				job->opts.resize = true;
+			} else if (strcmp(tok, "noflag") == 0) {
+				job->opts.no_flag = true;
+			} else if (strcmp(tok, "nocrc") == 0) {
+				job->opts.do_crc = false;
+			} else if (strcmp(tok, "reverse") == 0) {
+				job->opts.reverse = true;
+			} else if (strcmp(tok, "redundant") == 0) {
+				job->opts.redundant = true;
+			} else if (strncmp(tok, "overlay=", 8) == 0) {
+				if (batch_job_add_overlay(job, tok + 8)) {
+					err("Can't allocate batch job overlays\n");
+					goto out;
+				}
+			} else {
+				err("%s:%zu: Unknown option '%s'\n", manifest,
+				    lineno, tok);
+				goto out;
+			}
+		}
+	}
+
+	ret = 0;
+out:
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return ret;
+}
+
+static void batch_free(struct batch *b)
+{
+	size_t i, j;
+
+	for (i = 0; i < b->njobs; i++) {
+		free(b->jobs[i].source);
+		free(b->jobs[i].target);
+		if (b->jobs[i].own_overlays) {
+			for (j = 0; j < b->jobs[i].opts.noverlays; j++)
+				free((char *) b->jobs[i].opts.overlays[j]);
+			free(b->jobs[i].opts.overlays);
+		}
+	}
+	free(b->jobs);
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch *b = arg;
+	struct buffer buf = { NULL, 0 };
+	struct batch_job *job;
+	struct env_stats *st;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->njobs) {
+		job = &b->jobs[i];
+		st = b->stats ? &job->stats : NULL;
+		if (job->opts.verify)
+			job->status = uboot_env_verify(job->source, &job->opts,
+						       &job->info, &job->error, st);
+		else
+			job->status = uboot_env_convert(job->source, job->target,
+							&job->opts, &buf, st);
+	}
+
+	free(buf.ptr);
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Print the stats of each job (as JSON only) and the percentiles of the
+ * times of each phase over all jobs of a batch, which took wall_ns.
+ */
+static void batch_print_stats(const struct batch *b, uint64_t wall_ns,
+			      size_t failed)
+{
+	static const unsigned int pcts[] = { 50, 90, 99, 100 };
+	static const char *const pct_names[] = { "p50", "p90", "p99", "max" };
+	size_t bytes_in = 0, bytes_out = 0, i;
+	long minflt = 0, majflt = 0;
+	const struct env_stats *st;
+	unsigned int p, k;
+	uint64_t *ns;
+
+	ns = malloc(b->njobs * sizeof(*ns));
+	if (!ns) {
+		err("Can't allocate batch statistics\n");
+		return;
+	}
+
+	for (i = 0; i < b->njobs; i++) {
+		st = &b->jobs[i].stats;
+		if (b->stats == STATS_JSON)
+			stats_print(b->stats, b->jobs[i].source, b->jobs[i].target,
+				    b->jobs[i].status == 0, st);
+		bytes_in += st->bytes_in;
+		bytes_out += st->bytes_out;
+		for (p = 0; p < NR_STAT_PHASES; p++) {
+			minflt += st->minflt[p];
+			majflt += st->majflt[p];
+		}
+	}
+
+	if (b->stats == STATS_JSON)
+		fprintf(stderr, "{\"jobs\":%zu,\"failed\":%zu,\"wall_ns\":%" PRIu64
+			",\"bytes_in\":%zu,\"bytes_out\":%zu,\"minflt\":%ld,"
+			"\"majflt\":%ld,\"ns\":{", b->njobs, failed, wall_ns,
+			bytes_in, bytes_out, minflt, majflt);
+	else
+		info("stats: %zu jobs (%zu failed) in %.1f ms, %zu bytes in, "
+		     "%zu bytes out, %ld/%ld page faults (minor/major)\n",
+		     b->njobs, failed, wall_ns / 1000000.0, bytes_in, bytes_out,
+		     minflt, majflt);
+
+	/* one more round for the total */
+	for (p = 0; p <= NR_STAT_PHASES; p++) {
+		const char *name = p < NR_STAT_PHASES ? stat_phase_names[p] : "total";
+
+		for (i = 0; i < b->njobs; i++) {
+			st = &b->jobs[i].stats;
+			ns[i] = p < NR_STAT_PHASES ? st->ns[p] : stats_total_ns(st);
+		}
+		qsort(ns, b->njobs, sizeof(*ns), compare_u64);
+
+		if (b->stats == STATS_JSON)
+			fprintf(stderr, "%s\"%s\":{", p ? "," : "", name);
+		else
+			info("stats: %-8s", name);
+		for (k = 0; k < sizeof(pcts) / sizeof(pcts[0]); k++) {
+			/* nearest rank */
+			i = (pcts[k] * b->njobs + 99) / 100 - 1;
+			if (b->stats == STATS_JSON)
+				fprintf(stderr, "%s\"%s\":%" PRIu64, k ? "," : "",
+					pct_names[k], ns[i]);
+			else
+				fprintf(stderr, " %s %.1f us", pct_names[k],
+					ns[i] / 1000.0);
+		}
+		fputs(b->stats == STATS_JSON ? "}" : "\n", stderr);
+	}
+	if (b->stats == STATS_JSON)
+		fputs("}}\n", stderr);
+
+	free(ns);
+}
+
+/* run all jobs of a batch on a pool of one worker thread per online CPU */
+static int batch_run(struct batch *b)
+{
+	pthread_t *threads;
+	size_t nthreads, started, i, failed = 0;
+	struct timespec start, end;
+	long ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpus > 1 ? (size_t) ncpus : 1;
+	if (nthreads > b->njobs)
+		nthreads = b->njobs;
+
+	/* the calling thread is one of the workers */
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads) {
+		err("Can't allocate batch worker threads\n");
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 1; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, batch_worker, b) != 0)
+			break;
+	}
+	batch_worker(b);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < b->njobs; i++) {
+		if (b->jobs[i].status)
+			failed++;
+	}
+	if (b->stats && b->njobs > 0)
+		batch_print_stats(b, (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 +
+				  end.tv_nsec - start.tv_nsec, failed);
+	if (failed) {
+		if (!b->quiet)
+			err("%zu of %zu batch jobs failed\n", failed, b->njobs);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+	int status = EXIT_FAILURE;
+	unsigned long flags = 0;
+	const char *manifest = NULL;
+	bool slots = false;
+	struct env_edit *edits = NULL;
+	size_t nedits = 0;
+	const char **gets = NULL;
+	size_t ngets = 0;
+	unsigned int stats = 0;
+	struct env_stats st;
+	struct env_opts opts = {
+		.do_crc = true,
+		.align = 512,
+		.offset_b = -1,
+	};
+
+	if (argc < 2)
+		usage_and_exit(EXIT_FAILURE);
+
+	/* parse commandline options */
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			opts.img_size = parse_size(optarg);
+			if (opts.img_size == 0) {
+				err("Invalid target image size: %zu. Must be greater than 0.\n", opts.img_size);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'f':
+			opts.flags_size = FLAGS_SIZE;
+			flags = strtoul(optarg, NULL, 10);
+			if (flags != 0 && flags != 1) {
+				err("Wrong value for option -f. Should be 0 or 1.\n");
+				usage_and_exit(EXIT_FAILURE);
+			}
+			opts.flags = flags;
+			break;
+		case 'r':
+			opts.reverse = true;
+			break;
+		case 'R':
+			opts.redundant = true;
+			break;
+		case 'n':
+			opts.do_crc = false;
+			break;
+		case 'i': {
+			const char **overlays = realloc(opts.overlays,
+					(opts.noverlays + 1) * sizeof(*overlays));
+			if (!overlays) {
+				err("Can't allocate overlays\n");
+				exit(EXIT_FAILURE);
+			}
+			overlays[opts.noverlays++] = optarg;
+			opts.overlays = overlays;
+			break;
+		}
+		case OPT_BATCH:
+			manifest = optarg;
+			break;
+		case OPT_SLOTS:
+			slots = true;
+			break;
+		case OPT_OFFSET: {
+			const char *offset_b = strchr(optarg, ',');
+
+			opts.offset = parse_size(optarg);
+			opts.offset_b = offset_b ? (off_t) parse_size(offset_b + 1) : -1;
+			opts.in_place = true;
+			break;
+		}
+		case OPT_GET: {
+			const char **g = realloc(gets, (ngets + 1) * sizeof(*g));
+
+			if (!g) {
+				err("Can't allocate queries\n");
+				exit(EXIT_FAILURE);
+			}
+			gets = g;
+			gets[ngets++] = optarg;
+			break;
+		}
+		case OPT_VERIFY:
+			opts.verify = true;
+			break;
+		case OPT_UPDATE:
+			opts.update = true;
+			break;
+		case OPT_STRIP_CR:
+			opts.strip_cr = true;
+			break;
+		case OPT_DUPLICATES:
+			opts.duplicates = true;
+			break;
+		case OPT_RESIZE:
+			opts.resize = true;
+			break;
+		case OPT_NO_FLAG:
+			opts.no_flag = true;
+			break;
+		case OPT_ENDIAN:
+			if (parse_endian(optarg, &opts.endian)) {
+				err("Invalid byte order '%s', use big or little\n", optarg);
+				usage_and_exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_CACHE_DIR:
+			opts.cache_dir = optarg;
+			break;
+		case OPT_SCAN:
+			opts.scan = true;
+			break;
+		case OPT_CANONICAL:
+			opts.canonical = true;
+			break;
+		case OPT_ALIGN:
+			opts.align = parse_size(optarg);
+			if (opts.align == 0) {
+				err("Invalid alignment '%s'. Must be greater than 0.\n", optarg);
+				usage_and_exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_STATS:
+			if (!optarg || strcmp(optarg, "text") == 0)
+				stats = STATS_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				stats = STATS_JSON;
+			else {
+				err("Invalid statistics format '%s', use text or json\n", optarg);
+				usage_and_exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_PAD:
+			if (parse_pad(optarg, &opts.pad)) {
+				err("Invalid padding byte '%s', use 0x00 or 0xff\n", optarg);
+				usage_and_exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_SET:
+		case OPT_UNSET: {
+			struct env_edit *e = realloc(edits, (nedits + 1) * sizeof(*e));
+			char *eq = strchr(optarg, '=');
+
+			if (!e) {
+				err("Can't allocate edits\n");
+				exit(EXIT_FAILURE);
+			}
+			edits = e;
+			e = &edits[nedits++];
+			e->name = optarg;
+			e->name_len = eq ? (size_t) (eq - optarg) : strlen(optarg);
+			e->value = (c == OPT_SET && eq) ? eq + 1 : NULL;
+			if (e->name_len == 0 || (c == OPT_SET) != (eq != NULL)) {
+				err("Invalid argument '%s' for option --%s\n", optarg,
+				    c == OPT_SET ? "set" : "unset");
+				usage_and_exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'h':
+			status = EXIT_SUCCESS;
+			/* fall through */
+		default:
+			usage_and_exit(status);
+			break;
+		}
+	}
+	i = optind;
+
+	if (opts.offset_b >= 0 && !slots) {
+		err("A second offset is only valid with --slots\n");
+		usage_and_exit(EXIT_FAILURE);
+	}
+
+	if (manifest) {
+		struct batch b = { NULL, 0, 0, false, stats };
+
+		if (i != argc)
+			usage_and_exit(EXIT_FAILURE);
+		if (batch_parse(manifest, &opts, &b) == 0 && batch_run(&b) == 0)
+			status = EXIT_SUCCESS;
+		batch_free(&b);
+		goto out;
+	}
+
+	if (opts.verify) {
+		struct batch b = { NULL, 0, 0, true, stats };
+		size_t j;
+
+		/* we expect at least one image file */
+		if (i == argc)
+			usage_and_exit(EXIT_FAILURE);
+		b.jobs = calloc(argc - i, sizeof(*b.jobs));
+		if (!b.jobs) {
+			err("Can't allocate verify jobs\n");
+			goto out;
+		}
+		for (; i < argc; i++, b.njobs++) {
+			b.jobs[b.njobs].opts = opts;
+			b.jobs[b.njobs].source = strdup(argv[i]);
+			if (!b.jobs[b.njobs].source) {
+				err("Can't allocate verify jobs\n");
+				batch_free(&b);
+				goto out;
+			}
+		}
+		if (batch_run(&b) == 0)
+			status = EXIT_SUCCESS;
+		for (j = 0; j < b.njobs; j++)
+			verify_print_json(stdout, b.jobs[j].source, &b.jobs[j].info,
+					  b.jobs[j].error);
+		batch_free(&b);
+		goto out;
+	}
+
+	if (stats && (ngets > 0 || nedits > 0 || slots || opts.scan))
+		warn("Statistics are only available for conversions and --verify\n");
+
+	if (opts.scan) {
+		/* we expect at least one dump file */
+		if (i == argc)
+			usage_and_exit(EXIT_FAILURE);
+		if (opts.in_place)
+			warn("Offset will be ignored when scanning\n");
+		status = EXIT_SUCCESS;
+		for (; i < argc; i++) {
+			if (uboot_env_scan(argv[i], &opts))
+				status = EXIT_FAILURE;
+		}
+		goto out;
+	}
+
+	if (ngets > 0) {
+		/* we expect one filename */
+		if (i + 1 != argc)
+			usage_and_exit(EXIT_FAILURE);
+		if (uboot_env_get(argv[i], gets, ngets, &opts) == 0)
+			status = EXIT_SUCCESS;
+		goto out;
+	}
+
+	if (nedits > 0) {
+		/* we expect one filename */
+		if (i + 1 != argc)
+			usage_and_exit(EXIT_FAILURE);
+		if (uboot_env_edit_img(argv[i], edits, nedits, &opts) == 0)
+			status = EXIT_SUCCESS;
+		goto out;
+	}
+
+	if (slots) {
+		/* we expect the source and two slot filenames */
+		if (i + 3 != argc || opts.reverse)
+			usage_and_exit(EXIT_FAILURE);
+		if (opts.flags_size)
+			warn("Flags option will be ignored for slots\n");
+		if (uboot_env_write_slots(argv[i], argv[i + 1], argv[i + 2], &opts) == 0)
+			status = EXIT_SUCCESS;
+		goto out;
+	}
+
+	/* we expect two filenames */
+	if (i + 2 > argc)
+		usage_and_exit(EXIT_FAILURE);
+
+	if (opts.reverse && !opts.do_crc)
+		warn("Disabling of CRC generation will be ignored in reverse mode\n");
+
+	if (opts.reverse && opts.flags_size)
+		warn("Flags option will be ignored in reverse mode\n");
+
+	if (!opts.reverse && !opts.resize && opts.redundant)
+		warn("Redundant option will be ignored in forward mode, use -f instead\n");
+
+	if (opts.reverse && opts.noverlays)
+		warn("Overlays will be ignored in reverse mode\n");
+
+	if (opts.resize && opts.reverse)
+		usage_and_exit(EXIT_FAILURE);
+
+	if (opts.resize && opts.noverlays)
+		warn("Overlays will be ignored when resizing\n");
+
+	if ((opts.reverse || opts.resize) && opts.canonical)
+		warn("Canonical option will be ignored in reverse mode and when resizing\n");
+
+	if (opts.reverse && opts.redundant && opts.no_flag)
+		usage_and_exit(EXIT_FAILURE);
+
+	if (!opts.resize && !opts.reverse && opts.no_flag)
+		warn("No flag option will be ignored unless resizing or in reverse mode\n");
+
+	if (uboot_env_convert(argv[i], argv[i + 1], &opts, NULL, stats ? &st : NULL) == 0)
+		status = EXIT_SUCCESS;
+	if (stats)
+		stats_print(stats, argv[i], argv[i + 1], status == EXIT_SUCCESS, &st);
 
+out:
+	base_env_free_all();
+	free(opts.overlays);
+	free(edits);
+	free(gets);
 	exit(status);
 }
@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "xxh64.h"
+
+/* XXH64 as specified by Yann Collet, see https://github.com/Cyan4973/xxHash */
+#define PRIME1	0x9e3779b185ebca87ULL
+#define PRIME2	0xc2b2ae3d27d4eb4fULL
+#define PRIME3	0x165667b19e3779f9ULL
+#define PRIME4	0x85ebca77c2b2ae63ULL
+#define PRIME5	0x27d4eb2f165667c5ULL
+
+static inline uint64_t rotl64(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed)
+{
+	const uint8_t *p = buf, *end = p + len;
+	uint64_t v1, v2, v3, v4, h;
+
+	if (len >= 32) {
+		v1 = seed + PRIME1 + PRIME2;
+		v2 = seed + PRIME2;
+		v3 = seed;
+		v4 = seed - PRIME1;
+		do {
+			v1 = xxh64_round(v1, get_le64(p));
+			v2 = xxh64_round(v2, get_le64(p + 8));
+			v3 = xxh64_round(v3, get_le64(p + 16));
+			v4 = xxh64_round(v4, get_le64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + PRIME5;
+	}
+	h += len;
+
+	for (; end - p >= 8; p += 8) {
+		h ^= xxh64_round(0, get_le64(p));
+		h = rotl64(h, 27) * PRIME1 + PRIME4;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t) get_le32(p) * PRIME1;
+		h = rotl64(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * PRIME5;
+		h = rotl64(h, 11) * PRIME1;
+	}
+
+	/* avalanche */
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
@@ -0,0 +1,13 @@
+#ifndef _XXH64_H_
+#define _XXH64_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * XXH64 hash of len bytes at buf, not cryptographic. A hash can be extended
+ * by passing it as seed for the next buffer.
+ */
+extern uint64_t xxh64(const void *buf, size_t len, uint64_t seed);
+
+#endif /* _XXH64_H_ */